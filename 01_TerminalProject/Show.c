@@ -1,19 +1,49 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <ncurses.h>
 #include <locale.h>
 #include <stdlib.h>
 #include <sys/param.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sched.h>
+#include <stdint.h>
+#include <wchar.h>
+#include <zlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define DX 7
 #define DY 3
 #define BUFFER_SIZE 256
+#define INDEX_STEP (8 << 20)
+#define LINE_STEP 64
+#define SCAN_STEP (64 << 10)
+#define MAX_LINE (16 << 20)
+#define SEARCH_CHUNK (4 << 20)
+#define GZ_SPAN (4 << 20)
+#define GZ_KEEP (1 << 20)
+#define GZ_WINDOW 32768
+#define GZ_INPUT (64 << 10)
+#define MAX_RESTARTS (1 << 20)
+#define TAB_WIDTH 8
+#define WIDTH_STOP 64
+#define WIDTH_CACHE 256
+#define NO_MATCH SIZE_MAX
 
 #ifndef min
 #define min(a, b) (((int) a) < ((int) b) ? ((int) a) : ((int) b))
 #endif
 
-/*comments to display 
+/*comments to display
 very_long_line_1_very_long_line_2_very_long_line_3_very_long_line_4_very_long_line_5_very_long_line_6_very_long_line_7_very_long_line_8
 
 |\---/|
@@ -22,6 +52,928 @@ very_long_line_1_very_long_line_2_very_long_line_3_very_long_line_4_very_long_li
 
 */
 
+/* Where inflate can resume without starting over: compressed position (with
+ * `bits` of the previous byte left over) and the window the data after it needs */
+struct restart {
+    size_t out;
+    off_t in;
+    int bits;
+    size_t window_len;
+    unsigned char window[GZ_WINDOW];
+};
+
+struct gz;
+
+/* File contents (mapped, read into memory for pipes, or inflated on demand
+ * through a gz reader for gzip files) plus a sparse index:
+ * marks[k] is the offset of line k * LINE_STEP, nl counts newlines seen so far,
+ * tail is the offset right after the last one */
+struct text {
+    int fd;
+    const char *data;
+    size_t size;
+    int mapped;
+    size_t *marks;
+    size_t nmarks;
+    size_t cap;
+    size_t nl;
+    size_t tail;
+    size_t nlines;
+    size_t scanned;
+    size_t cur_line;
+    size_t cur_off;
+    struct gz *gz;
+    struct gz *indexer;
+    struct restart **restarts;
+    size_t nrestarts;
+};
+
+/* Background search. `lock` guards the fields below and also the text mapping,
+ * which the main thread only replaces (follow mode) while holding it */
+struct search {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int started;
+    int efd;
+    int quit;
+    unsigned gen;
+    int pending;
+    int active;
+    regex_t re;
+    int is_regex;
+    char literal[BUFFER_SIZE];
+    size_t literal_len;
+    size_t from;
+    int dir;
+    int done;
+    size_t found;
+    struct text *text;
+    struct gz *reader;
+};
+
+/* Display columns of one line: (byte, column) pairs every WIDTH_STOP characters,
+ * none for plain ASCII lines where the two are the same */
+struct widths {
+    size_t line;
+    size_t len;
+    int valid;
+    int ascii;
+    size_t *stops;
+    size_t nstops;
+};
+
+/* What is on screen: rows in `damage` are repainted on the next frame,
+ * and a change of `top` since `drawn_top` is applied as a scroll */
+struct view {
+    WINDOW *screen;
+    WINDOW *win;
+    struct text *text;
+    size_t top;
+    size_t drawn_top;
+    size_t left;
+    int height;
+    int width;
+    char *damage;
+    char *row_buf;
+    struct widths *widths;
+    char status[64];
+    struct search *search;
+    size_t match_line;
+    const char *message;
+    int follow;
+    int stats;
+    int io_fd;
+    size_t frames;
+    size_t frame_bytes;
+    size_t total_bytes;
+};
+
+
+/* Decompressed bytes [start, out) of a gzip file, inflated on demand by one thread.
+ * Jumps restart from the nearest restart point instead of the beginning */
+struct gz {
+    int fd;
+    z_stream strm;
+    int active;
+    int raw;
+    int skip;
+    int eof;
+    off_t in;
+    size_t out;
+    size_t start;
+    size_t last_restart;
+    char *buf;
+    size_t cap;
+    struct text *text;
+    int indexer;
+    unsigned char input[GZ_INPUT];
+};
+
+void gz_free(struct gz *z) {
+    if (!z) {
+        return;
+    }
+    if (z->active) {
+        inflateEnd(&z->strm);
+    }
+    free(z->buf);
+    free(z);
+}
+
+struct gz *gz_new(struct text *t, int indexer) {
+    struct gz *z = calloc(1, sizeof(*z));
+    if (!z) {
+        return NULL;
+    }
+    z->fd = t->fd;
+    z->text = t;
+    z->indexer = indexer;
+    z->eof = 1;
+    return z;
+}
+
+/* Restart inflating at restart point `r`, or at the beginning of the file */
+int gz_seek(struct gz *z, const struct restart *r) {
+    if (z->active) {
+        inflateEnd(&z->strm);
+    }
+    memset(&z->strm, 0, sizeof(z->strm));
+    z->active = inflateInit2(&z->strm, r ? -15 : 15 + 32) == Z_OK;
+    z->raw = r != NULL;
+    z->skip = 0;
+    z->eof = !z->active;
+    z->in = r ? r->in : 0;
+    z->out = z->start = r ? r->out : 0;
+    if (r && z->active) {
+        if (r->bits) {
+            unsigned char c;
+            z->eof = pread(z->fd, &c, 1, --z->in) != 1;
+            z->in++;
+            inflatePrime(&z->strm, r->bits, c >> (8 - r->bits));
+        }
+        inflateSetDictionary(&z->strm, r->window, r->window_len);
+    }
+    return z->eof ? -1 : 0;
+}
+
+/* Remember where inflate can be restarted, at most every GZ_SPAN output bytes */
+void gz_add_restart(struct gz *z) {
+    struct text *t = z->text;
+    if (z->raw || !(z->strm.data_type & 128) || (z->strm.data_type & 64) ||
+        z->out < z->last_restart + GZ_SPAN || t->nrestarts == MAX_RESTARTS) {
+        return;
+    }
+    struct restart *r = malloc(sizeof(*r));
+    if (!r) {
+        return;
+    }
+    r->out = z->out;
+    r->in = z->in - z->strm.avail_in;
+    r->bits = z->strm.data_type & 7;
+    r->window_len = MIN(z->out - z->start, GZ_WINDOW);
+    memcpy(r->window, z->buf + (z->out - z->start) - r->window_len, r->window_len);
+    t->restarts[t->nrestarts] = r;
+    /* the search thread reads the list without taking a lock */
+    __atomic_store_n(&t->nrestarts, t->nrestarts + 1, __ATOMIC_RELEASE);
+    z->last_restart = z->out;
+}
+
+/* Inflate at least up to uncompressed offset `until` (or to the end) */
+void gz_fill(struct gz *z, size_t until) {
+    while (!z->eof && z->out < until) {
+        size_t used = z->out - z->start;
+        if (z->cap - used < GZ_INPUT) {
+            size_t cap = MAX(2 * z->cap, used + 4 * GZ_INPUT);
+            char *tmp = realloc(z->buf, cap);
+            if (!tmp) {
+                z->eof = 1;
+                break;
+            }
+            z->buf = tmp;
+            z->cap = cap;
+        }
+        if (z->strm.avail_in == 0) {
+            ssize_t got = pread(z->fd, z->input, GZ_INPUT, z->in);
+            if (got <= 0) {
+                z->eof = 1;
+                break;
+            }
+            z->in += got;
+            z->strm.next_in = z->input;
+            z->strm.avail_in = got;
+        }
+        if (z->skip) {
+            /* gzip trailer after a member inflated in raw mode */
+            unsigned n = MIN((unsigned)z->skip, z->strm.avail_in);
+            z->strm.next_in += n;
+            z->strm.avail_in -= n;
+            if ((z->skip -= n) == 0) {
+                z->eof = inflateReset2(&z->strm, 15 + 16) != Z_OK;
+                z->raw = 0;
+            }
+            continue;
+        }
+        z->strm.next_out = (unsigned char *)z->buf + used;
+        z->strm.avail_out = z->cap - used;
+        int ret = inflate(&z->strm, Z_BLOCK);
+        z->out = z->start + (z->cap - z->strm.avail_out);
+        if (ret == Z_STREAM_END) {
+            /* concatenated members, as left by `cat a.gz b.gz` or rotation tools */
+            if (z->raw) {
+                z->skip = 8;
+            } else {
+                z->eof = inflateReset(&z->strm) != Z_OK;
+            }
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            z->eof = 1;
+        } else if (z->indexer) {
+            gz_add_restart(z);
+        }
+    }
+}
+
+/* Up to `len` bytes at uncompressed offset `off`, contiguous, valid until the
+ * next call; fewer only at the end of the data */
+const char *gz_range(struct gz *z, size_t off, size_t len, size_t *got) {
+    struct text *t = z->text;
+    size_t n = __atomic_load_n(&t->nrestarts, __ATOMIC_ACQUIRE);
+    if (!z->active || off < z->start || off > z->out + GZ_SPAN) {
+        const struct restart *r = NULL;
+        for (size_t lo = 0, hi = n; lo < hi;) {
+            size_t mid = (lo + hi) / 2;
+            if (t->restarts[mid]->out <= off) {
+                r = t->restarts[mid];
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (!z->active || off < z->start || (r && r->out > z->out)) {
+            gz_seek(z, r);
+        }
+    }
+    /* keep a little history so that stepping back a few lines does not restart */
+    if (off > z->start + 2 * GZ_KEEP && z->out > z->start) {
+        size_t drop = MIN(off - GZ_KEEP, z->out) - z->start;
+        memmove(z->buf, z->buf + drop, z->out - z->start - drop);
+        z->start += drop;
+    }
+    gz_fill(z, off + MAX(len, 1));
+    if (off >= z->out) {
+        *got = 0;
+        return NULL;
+    }
+    *got = MIN(len, z->out - off);
+    return z->buf + (off - z->start);
+}
+
+
+void text_close(struct text *t);
+
+/* On failure nothing is left open or allocated and t->fd is -1 */
+int text_open(struct text *t, const char *filename) {
+    memset(t, 0, sizeof(*t));
+    t->fd = -1;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    unsigned char magic[2];
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (S_ISREG(st.st_mode) && pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        t->fd = fd;
+        t->restarts = calloc(MAX_RESTARTS, sizeof(*t->restarts));
+        t->gz = gz_new(t, 0);
+        t->indexer = gz_new(t, 1);
+        if (!t->restarts || !t->gz || !t->indexer || gz_seek(t->indexer, NULL) < 0) {
+            text_close(t);
+            t->fd = -1;
+            return -1;
+        }
+    } else if (S_ISREG(st.st_mode)) {
+        void *p = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+        if (p != MAP_FAILED) {
+            t->data = p;
+            t->size = st.st_size;
+            t->mapped = 1;
+            t->fd = fd;
+        }
+    }
+    if (!t->mapped && !t->gz) {
+        char *buf = NULL;
+        size_t cap = 0;
+        ssize_t got;
+        do {
+            if (t->size == cap) {
+                cap = cap ? 2 * cap : BUFFER_SIZE;
+                char *tmp = realloc(buf, cap);
+                if (!tmp) {
+                    free(buf);
+                    close(fd);
+                    return -1;
+                }
+                buf = tmp;
+            }
+            got = read(fd, buf + t->size, cap - t->size);
+            if (got > 0) {
+                t->size += got;
+            }
+        } while (got > 0);
+        t->data = buf;
+        close(fd);
+    }
+    t->cap = 1024;
+    t->marks = malloc(t->cap * sizeof(*t->marks));
+    if (!t->marks) {
+        text_close(t);
+        t->fd = -1;
+        return -1;
+    }
+    t->marks[t->nmarks++] = 0;
+    t->nlines = t->size > 0;
+    return 0;
+}
+
+/* Also releases a text that text_open() only half set up */
+void text_close(struct text *t) {
+    gz_free(t->gz);
+    gz_free(t->indexer);
+    if (t->restarts) {
+        for (size_t i = 0; i < t->nrestarts; i++) {
+            free(t->restarts[i]);
+        }
+        free(t->restarts);
+    }
+    if (t->mapped) {
+        if (t->data) {
+            munmap((void *)t->data, t->size);
+        }
+    } else {
+        free((void *)t->data);
+    }
+    if (t->fd >= 0) {
+        close(t->fd);
+    }
+    free(t->marks);
+}
+
+/* Map the part of the file written since the last call.
+ * Returns 1 if it grew, 0 if unchanged, -1 if it was truncated */
+int text_reload(struct text *t) {
+    struct stat st;
+    if (!t->mapped || fstat(t->fd, &st) < 0 || (size_t)st.st_size == t->size) {
+        return 0;
+    }
+    if ((size_t)st.st_size < t->size) {
+        return -1;
+    }
+    void *p = t->data ? mremap((void *)t->data, t->size, st.st_size, MREMAP_MAYMOVE)
+                      : mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, t->fd, 0);
+    if (p == MAP_FAILED) {
+        return 0;
+    }
+    t->data = p;
+    t->size = st.st_size;
+    t->nlines = t->nl + (t->tail < t->size);
+    return 1;
+}
+
+/* Up to `len` bytes of text at `off` through reader `z` (each thread has its own,
+ * NULL for plain files): straight from memory, or inflated for gzip files */
+const char *text_range(struct text *t, struct gz *z, size_t off, size_t len, size_t *got) {
+    if (z) {
+        return gz_range(z, off, len, got);
+    }
+    *got = off < t->size ? MIN(len, t->size - off) : 0;
+    return off < t->size ? t->data + off : NULL;
+}
+
+/* Offset of the first '\n' at or after `off`, or the end of the text */
+size_t text_find_nl(struct text *t, struct gz *z, size_t off) {
+    const char *p, *nl;
+    size_t got;
+    while ((p = text_range(t, z, off, SCAN_STEP, &got))) {
+        if ((nl = memchr(p, '\n', got))) {
+            return off + (nl - p);
+        }
+        off += got;
+    }
+    return off;
+}
+
+int text_indexed(const struct text *t) {
+    return t->gz ? t->indexer->eof && t->scanned >= t->size : t->scanned >= t->size;
+}
+
+/* Index up to `budget` more bytes, returns nonzero while something is left */
+int text_index_step(struct text *t, size_t budget) {
+    size_t got;
+    const char *data = t->gz ? gz_range(t->indexer, t->scanned, budget, &got)
+                             : text_range(t, NULL, t->scanned, budget, &got);
+    size_t begin = t->scanned;
+    size_t end = begin + got;
+    if (t->gz) {
+        /* compressed data is only known as far as it has been inflated */
+        t->size = MAX(t->size, end);
+    }
+    while (t->scanned < end) {
+        const char *nl = memchr(data + (t->scanned - begin), '\n', end - t->scanned);
+        if (!nl) {
+            t->scanned = end;
+            break;
+        }
+        t->scanned = t->tail = begin + (nl - data) + 1;
+        if (++t->nl % LINE_STEP) {
+            continue;
+        }
+        if (t->nmarks == t->cap) {
+            size_t *tmp = realloc(t->marks, 2 * t->cap * sizeof(*t->marks));
+            if (!tmp) {
+                t->scanned = t->size;
+                break;
+            }
+            t->marks = tmp;
+            t->cap *= 2;
+        }
+        t->marks[t->nmarks++] = t->scanned;
+    }
+    t->nlines = t->nl + (t->tail < t->size);
+    return !text_indexed(t);
+}
+
+/* Index until line `n` is known to exist or the whole file is scanned */
+int text_has_line(struct text *t, size_t n) {
+    while (t->nlines <= n && text_index_step(t, SCAN_STEP)) {
+    }
+    return n < t->nlines;
+}
+
+/* Line `n` (without '\n'), NULL past the end: a pointer into the mapping, or into
+ * the inflated data for compressed files. Starts from the nearest checkpoint or
+ * the previous lookup, whichever is closer; its offset is left in cur_off */
+const char *text_line(struct text *t, size_t n, size_t *len) {
+    if (!text_has_line(t, n)) {
+        return NULL;
+    }
+    size_t line = n - n % LINE_STEP;
+    size_t off = t->marks[n / LINE_STEP];
+    if (t->cur_line <= n && t->cur_line > line) {
+        line = t->cur_line;
+        off = t->cur_off;
+    }
+    for (; line < n; line++) {
+        off = text_find_nl(t, t->gz, off) + 1;
+    }
+    t->cur_line = n;
+    t->cur_off = off;
+    size_t got;
+    *len = MIN(text_find_nl(t, t->gz, off) - off, MAX_LINE);
+    return text_range(t, t->gz, off, *len, &got);
+}
+
+
+/* Line number of the line containing byte `off` */
+size_t text_line_of(struct text *t, size_t off) {
+    while (t->scanned <= off && text_index_step(t, INDEX_STEP)) {
+    }
+    size_t lo = 0, hi = t->nmarks;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (t->marks[mid] <= off) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t line = lo * LINE_STEP;
+    for (size_t pos = t->marks[lo]; (pos = text_find_nl(t, t->gz, pos)) < off; pos++) {
+        line++;
+    }
+    return line;
+}
+
+
+/* The `]` closing the bracket expression that starts at `p`, NULL if there is none.
+ * A `]` right after `[` or `[^` is a literal, and [:class:], [.coll.] and [=equiv=]
+ * are stepped over as a whole. */
+const char *skip_bracket(const char *p) {
+    p++;
+    p += *p == '^';
+    p += *p == ']';
+    for (; *p; p++) {
+        if (*p == '[' && p[1] && strchr(":.=", p[1])) {
+            const char *close = p + 2;
+            while (close[0] && !(close[0] == p[1] && close[1] == ']')) {
+                close++;
+            }
+            if (!close[0]) {
+                return NULL;
+            }
+            p = close + 1;
+        } else if (*p == ']') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* Longest run of characters every match must contain, so candidates can be found
+ * with memmem before regexec runs. Empty if the pattern has alternations, or if
+ * it has no metacharacters at all (then it is searched as a plain literal). */
+size_t required_literal(const char *pattern, char *out, size_t size, int *is_regex) {
+    size_t best = 0, run = 0, depth = 0;
+    char cur[BUFFER_SIZE];
+    *is_regex = strpbrk(pattern, ".[]()*+?{}|^$\\") != NULL;
+    if (!*is_regex) {
+        snprintf(out, size, "%s", pattern);
+        return strlen(out);
+    }
+    if (strchr(pattern, '|')) {
+        return 0;
+    }
+    for (const char *p = pattern; *p; p++) {
+        char c = *p;
+        int literal = 0;
+        if (c == '\\') {
+            literal = p[1] && strchr(".[]()*+?{}|^$\\", p[1]) && depth == 0;
+            c = p[1] ? *++p : c;
+        } else if (c == '{') {
+            if (!(p = strchr(p, '}'))) {
+                break;
+            }
+        } else if (c == '[') {
+            if (!(p = skip_bracket(p))) {
+                break;
+            }
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth -= depth > 0;
+        } else {
+            literal = depth == 0 && !strchr(".*+?{}^$\\", c);
+        }
+        if (literal && !(p[1] && strchr("*?{", p[1])) && run < sizeof(cur) - 1) {
+            cur[run++] = c;
+            if (run > best && run < size) {
+                memcpy(out, cur, run);
+                best = run;
+            }
+        } else {
+            run = 0;
+        }
+    }
+    return best;
+}
+
+/* Offset of the start of the first matching line in `chunk`, NO_MATCH if none.
+ * The chunk holds whole lines. */
+size_t search_range(struct search *s, const char *chunk, size_t len) {
+    const char *p = chunk, *end = chunk + len;
+    while (p < end) {
+        if (s->literal_len) {
+            p = memmem(p, end - p, s->literal, s->literal_len);
+            if (!p) {
+                return NO_MATCH;
+            }
+        }
+        const char *ls = memrchr(chunk, '\n', p - chunk);
+        ls = ls ? ls + 1 : chunk;
+        const char *le = s->literal_len ? memchr(p, '\n', end - p) : NULL;
+        le = le ? le : end;
+        if (!s->is_regex) {
+            return ls - chunk;
+        }
+        regmatch_t m = {.rm_so = 0, .rm_eo = le - ls};
+        if (regexec(&s->re, ls, 1, &m, REG_STARTEND) == 0) {
+            if (s->literal_len) {
+                return ls - chunk;
+            }
+            const char *ms = memrchr(ls, '\n', m.rm_so);
+            return ms ? (size_t)(ms + 1 - chunk) : (size_t)(ls - chunk);
+        }
+        p = le + 1;
+    }
+    return NO_MATCH;
+}
+
+/* Scan one chunk from s->from in direction s->dir; returns nonzero when done */
+int search_chunk(struct search *s) {
+    struct text *t = s->text;
+    const char *p, *nl;
+    size_t got, found, len = SEARCH_CHUNK;
+    if (t->gz && !s->reader) {
+        s->reader = gz_new(t, 0);
+    }
+    if (s->dir > 0) {
+        /* cut the chunk after its last complete line, growing it for huge lines */
+        int last = 0;
+        while ((p = text_range(t, s->reader, s->from, len, &got)) && !(last = got < len)) {
+            if ((nl = memrchr(p, '\n', got))) {
+                got = nl - p;
+                break;
+            }
+            len *= 2;
+        }
+        found = p ? search_range(s, p, got) : NO_MATCH;
+        s->found = found == NO_MATCH ? NO_MATCH : s->from + found;
+        s->from += got + 1;
+        return !p || s->found != NO_MATCH || last;
+    }
+    size_t end = s->from, begin;
+    s->found = NO_MATCH;
+    if (end == 0) {
+        return 1;
+    }
+    /* start the chunk at its first complete line, growing it for huge lines */
+    for (;;) {
+        begin = end > len ? end - len : 0;
+        p = text_range(t, s->reader, begin, end - begin, &got);
+        if (!p) {
+            return 1;
+        }
+        nl = begin ? memchr(p, '\n', got) : NULL;
+        if (!begin || nl) {
+            break;
+        }
+        len *= 2;
+    }
+    if (nl) {
+        got -= nl + 1 - p;
+        begin += nl + 1 - p;
+        p = nl + 1;
+    }
+    /* the last match in the chunk is the closest one */
+    for (size_t pos = 0; pos < got && (found = search_range(s, p + pos, got - pos)) != NO_MATCH;) {
+        s->found = begin + pos + found;
+        nl = memchr(p + pos + found, '\n', got - pos - found);
+        pos = nl ? (size_t)(nl + 1 - p) : got;
+    }
+    s->from = begin;
+    return s->found != NO_MATCH || begin == 0;
+}
+
+void *search_main(void *arg) {
+    struct search *s = arg;
+    pthread_mutex_lock(&s->lock);
+    while (!s->quit) {
+        if (!s->pending) {
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        s->pending = 0;
+        unsigned gen = s->gen;
+        while (!search_chunk(s)) {
+            /* let the main thread remap the file or post a new request */
+            pthread_mutex_unlock(&s->lock);
+            sched_yield();
+            pthread_mutex_lock(&s->lock);
+            if (gen != s->gen || s->quit) {
+                break;
+            }
+        }
+        if (gen == s->gen && !s->quit) {
+            s->done = 1;
+            uint64_t one = 1;
+            if (write(s->efd, &one, sizeof(one)) < 0) {
+                s->done = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+int search_init(struct search *s, struct text *text) {
+    memset(s, 0, sizeof(*s));
+    s->text = text;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return s->efd < 0 ? -1 : 0;
+}
+
+void search_close(struct search *s) {
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    if (s->started) {
+        pthread_join(s->thread, NULL);
+    }
+    if (s->active && s->is_regex) {
+        regfree(&s->re);
+    }
+    if (s->reader) {
+        gz_free(s->reader);
+    }
+    close(s->efd);
+}
+
+/* Set a new pattern; returns 0 on success or a message describing the error */
+const char *search_set(struct search *s, const char *pattern) {
+    static char error[BUFFER_SIZE];
+    pthread_mutex_lock(&s->lock);
+    s->gen++;
+    if (s->active && s->is_regex) {
+        regfree(&s->re);
+    }
+    s->active = 0;
+    s->literal_len = required_literal(pattern, s->literal, sizeof(s->literal), &s->is_regex);
+    int err = s->is_regex ? regcomp(&s->re, pattern, REG_EXTENDED | REG_NEWLINE) : 0;
+    if (err) {
+        regerror(err, &s->re, error, sizeof(error));
+        s->is_regex = 0;
+    }
+    s->active = !err && *pattern;
+    pthread_mutex_unlock(&s->lock);
+    return err ? error : NULL;
+}
+
+/* Start looking for the first match after (dir > 0) or before (dir < 0) `from` */
+void search_request(struct search *s, size_t from, int dir) {
+    pthread_mutex_lock(&s->lock);
+    s->gen++;
+    s->from = from;
+    s->dir = dir;
+    s->pending = 1;
+    s->done = 0;
+    pthread_cond_signal(&s->cond);
+    if (!s->started) {
+        s->started = pthread_create(&s->thread, NULL, search_main, s) == 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Result of the last request once it is finished, NO_MATCH otherwise */
+int search_result(struct search *s, size_t *found) {
+    uint64_t cnt;
+    int done;
+    if (read(s->efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        return 0;
+    }
+    pthread_mutex_lock(&s->lock);
+    done = s->done;
+    *found = s->found;
+    s->done = 0;
+    pthread_mutex_unlock(&s->lock);
+    return done;
+}
+
+/* Nonzero if `len` bytes are all printable ASCII, checked a word at a time */
+int plain_ascii(const char *str, size_t len) {
+    const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t x;
+        memcpy(&x, str + i, 8);
+        /* any byte >= 0x80, < 0x20 or == 0x7f */
+        uint64_t del = x ^ (0x7f * ones);
+        if ((x | ((x - 0x20 * ones) & ~x) | ((del - ones) & ~del)) & highs) {
+            return 0;
+        }
+    }
+    for (; i < len; i++) {
+        if ((unsigned char)str[i] < 0x20 || (unsigned char)str[i] >= 0x7f) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Columns taken by the character at `str` (at most `len` bytes) if it starts at
+ * column `col`; its size in bytes goes to `*bytes`. Tabs go to the next stop,
+ * control characters are shown as ^X, invalid sequences as '?' */
+int char_width(const char *str, size_t len, size_t col, size_t *bytes) {
+    unsigned char c = *str;
+    *bytes = 1;
+    if (c >= 0x20 && c < 0x7f) {
+        return 1;
+    } else if (c == '\t') {
+        return TAB_WIDTH - col % TAB_WIDTH;
+    } else if (c < 0x20 || c == 0x7f) {
+        return 2;
+    }
+    wchar_t wc;
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+    size_t n = mbrtowc(&wc, str, len, &state);
+    if (n == 0 || n > len) {
+        return 1;
+    }
+    *bytes = n;
+    int w = wcwidth(wc);
+    return w < 0 ? 1 : w;
+}
+
+/* Width table of line `line`, from the cache unless the line changed length */
+struct widths *line_widths(struct view *v, size_t line, const char *str, size_t len) {
+    struct widths *w = &v->widths[line % WIDTH_CACHE];
+    if (w->valid && w->line == line && w->len == len) {
+        return w;
+    }
+    w->valid = 1;
+    w->line = line;
+    w->len = len;
+    w->nstops = 0;
+    w->ascii = plain_ascii(str, len);
+    if (w->ascii) {
+        return w;
+    }
+    size_t cap = 2 * (len / WIDTH_STOP + 1);
+    size_t *stops = realloc(w->stops, cap * sizeof(*stops));
+    if (!stops) {
+        w->valid = 0;
+        return NULL;
+    }
+    w->stops = stops;
+    size_t byte = 0, col = 0, bytes;
+    for (size_t chars = 0; byte < len; chars++) {
+        if (chars % WIDTH_STOP == 0) {
+            stops[w->nstops++] = byte;
+            stops[w->nstops++] = col;
+        }
+        col += char_width(str + byte, len - byte, col, &bytes);
+        byte += bytes;
+    }
+    return w;
+}
+
+void widths_reset(struct view *v) {
+    for (int i = 0; i < WIDTH_CACHE; i++) {
+        v->widths[i].valid = 0;
+    }
+}
+
+/* Walk from the closest stop to the last character starting at or before column
+ * `col` (by_col) or byte `byte` (otherwise); returns its byte offset, column in *at */
+size_t widths_seek(const struct widths *w, const char *str, int by_col, size_t target, size_t *at) {
+    if (!w || w->ascii) {
+        *at = MIN(target, w ? w->len : target);
+        return *at;
+    }
+    size_t lo = 0, hi = w->nstops / 2;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (w->stops[2 * mid + (by_col ? 1 : 0)] <= target) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t byte = w->nstops ? w->stops[2 * lo] : 0, col = w->nstops ? w->stops[2 * lo + 1] : 0, bytes;
+    while (byte < w->len) {
+        int cw = char_width(str + byte, w->len - byte, col, &bytes);
+        if ((by_col ? col + cw : byte + bytes) > target) {
+            break;
+        }
+        col += cw;
+        byte += bytes;
+    }
+    *at = col;
+    return byte;
+}
+
+/* Reverse-video every match of the current pattern that is at least partly
+ * inside the visible columns [left, left + width) */
+void highlight_matches(struct view *v, int row, const char *str, size_t len, const struct widths *w) {
+    struct search *s = v->search;
+    size_t pos = 0, col;
+    size_t end = widths_seek(w, str, 1, v->left + v->width, &col);
+    end = MIN(len, end + 4 * TAB_WIDTH);
+    while (s->active && pos < end) {
+        size_t so, eo, cs, ce;
+        if (s->is_regex) {
+            regmatch_t m = {.rm_so = pos, .rm_eo = len};
+            if (regexec(&s->re, str, 1, &m, REG_STARTEND | (pos ? REG_NOTBOL : 0)) != 0) {
+                break;
+            }
+            so = m.rm_so;
+            eo = m.rm_eo;
+        } else {
+            const char *p = memmem(str + pos, len - pos, s->literal, s->literal_len);
+            if (!p) {
+                break;
+            }
+            so = p - str;
+            eo = so + s->literal_len;
+        }
+        if (eo > so) {
+            widths_seek(w, str, 0, so, &cs);
+            widths_seek(w, str, 0, eo, &ce);
+            cs = MAX(cs, v->left);
+            ce = MIN(ce, v->left + v->width);
+            if (ce > cs) {
+                mvwchgat(v->win, row, cs - v->left, ce - cs, A_REVERSE, 0, NULL);
+            }
+        }
+        pos = eo > so ? eo : so + 1;
+    }
+}
 
 void draw_border(WINDOW *screen, const char *filename) {
     box(screen, 0, 0);
@@ -30,46 +982,382 @@ void draw_border(WINDOW *screen, const char *filename) {
     wrefresh(screen);
 }
 
-void shrink_str(char *str, int width) {
-    int str_cur_len = strnlen(str, BUFFER_SIZE);
-    if (str_cur_len > 0 && str[str_cur_len - 1] == '\n') {
-        str[str_cur_len - 1] = '\0';
-        str_cur_len--;
+/* Draw the columns [left, left + width) of a line: whole characters only, a wide
+ * one cut by either edge is replaced with blanks */
+void draw_line(struct view *v, int row, const char *str, size_t len, const struct widths *w) {
+    size_t col, bytes, n = 0, right = v->left + v->width;
+    size_t byte = widths_seek(w, str, 1, v->left, &col);
+    char *out = v->row_buf;
+    wmove(v->win, row, 0);
+    if (!w || w->ascii) {
+        waddnstr(v->win, str + byte, MIN(len - byte, (size_t)v->width));
+        wclrtoeol(v->win);
+        return;
+    }
+    while (byte < len && col < right && n < (size_t)v->width * 8) {
+        const char *c = str + byte;
+        int cw = char_width(c, len - byte, col, &bytes);
+        if (col < v->left || col + cw > right || *c == '\t') {
+            for (size_t i = MAX(col, v->left); i < MIN(col + cw, right); i++) {
+                out[n++] = ' ';
+            }
+        } else if ((unsigned char)*c < 0x20 || *c == 0x7f) {
+            out[n++] = '^';
+            out[n++] = *c ^ 0x40;
+        } else if (bytes == 1 && (unsigned char)*c >= 0x80) {
+            out[n++] = '?';
+        } else {
+            memcpy(out + n, c, bytes);
+            n += bytes;
+        }
+        col += cw;
+        byte += bytes;
+    }
+    waddnstr(v->win, out, n);
+    wclrtoeol(v->win);
+}
+
+void damage(struct view *v, int from, int to) {
+    for (int row = MAX(from, 0); row < MIN(to, v->height); row++) {
+        v->damage[row] = 1;
+    }
+}
+
+/* Repaint everything, without trying to reuse what is on screen */
+void display_page(struct view *v) {
+    damage(v, 0, v->height);
+    v->drawn_top = v->top;
+}
+
+/* Scroll by one line in direction `dir` if there is a line to show there */
+int update(struct view *v, int dir) {
+    if (dir < 0 ? v->top == 0 : !text_has_line(v->text, v->top + v->height)) {
+        return 0;
+    }
+    v->top += dir;
+    return dir;
+}
+
+/* Bytes written by this process so far, all of which go to the terminal */
+size_t tty_written(int io_fd) {
+    char buf[512];
+    ssize_t len = pread(io_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) {
+        return 0;
     }
-    int len = min(str_cur_len, width);
-    str[len] = '\0';
+    buf[len] = '\0';
+    const char *p = strstr(buf, "wchar:");
+    return p ? strtoull(p + 6, NULL, 10) : 0;
 }
 
+void draw_status(struct view *v) {
+    char status[sizeof(v->status)], left[32] = "", bytes[32] = "";
+    if (v->left) {
+        snprintf(left, sizeof(left), ">%zu ", v->left);
+    }
+    if (v->stats) {
+        snprintf(bytes, sizeof(bytes), "%zuB ", v->frame_bytes);
+    }
+    int len = snprintf(status, sizeof(status), " %s%s%zu/%zu%s %s%s", v->message ? v->message : "",
+                       v->follow ? "F " : "", v->top + 1, v->text->nlines,
+                       text_indexed(v->text) ? "" : "+", left, bytes);
+    if (len >= (int)sizeof(status)) {
+        /* a long message is cut, ending the line with a space as usual */
+        status[sizeof(status) - 2] = ' ';
+    }
+    if (strcmp(status, v->status) == 0) {
+        return;
+    }
+    strcpy(v->status, status);
+    int row = getmaxy(v->screen) - 1;
+    int col = getmaxx(v->screen) - (int)strlen(status) - 2;
+    mvwhline(v->screen, row, 1, ACS_HLINE, getmaxx(v->screen) - 2);
+    mvwaddstr(v->screen, row, col > 1 ? col : 1, status);
+    wnoutrefresh(v->screen);
+}
 
-int display_first_page(WINDOW *win, FILE *file, int height, int width, char *buffer) {
-    scrollok(win, TRUE);
-    int line_cnt = 0;
-    while (line_cnt < height && fgets(buffer, BUFFER_SIZE, file)) {
-        shrink_str(buffer, width);
-        wprintw(win, "%s\n", buffer);
-        line_cnt++;
+/* One frame: scroll what can be reused (ncurses turns this into a hardware
+ * scroll since idlok is on), repaint damaged rows, flush once with doupdate */
+void render(struct view *v) {
+    if (v->top != v->drawn_top) {
+        long delta = (long)(v->top - v->drawn_top);
+        if (labs(delta) < v->height) {
+            /* only while scrolling: a full last row must not scroll the window */
+            scrollok(v->win, TRUE);
+            wscrl(v->win, delta);
+            scrollok(v->win, FALSE);
+            damage(v, delta > 0 ? v->height - delta : 0, delta > 0 ? v->height : -delta);
+        } else {
+            damage(v, 0, v->height);
+        }
+        v->drawn_top = v->top;
     }
-    wrefresh(win);
-    return line_cnt;
+    const char *str;
+    size_t len;
+    for (int row = 0; row < v->height; row++) {
+        if (!v->damage[row]) {
+            continue;
+        }
+        v->damage[row] = 0;
+        if ((str = text_line(v->text, v->top + row, &len))) {
+            const struct widths *w = line_widths(v, v->top + row, str, len);
+            draw_line(v, row, str, len, w);
+            highlight_matches(v, row, str, len, w);
+        } else {
+            wmove(v->win, row, 0);
+            wclrtoeol(v->win);
+        }
+    }
+    draw_status(v);
+    wnoutrefresh(v->win);
+    size_t before = v->stats ? tty_written(v->io_fd) : 0;
+    doupdate();
+    if (v->stats) {
+        v->frame_bytes = tty_written(v->io_fd) - before;
+        v->total_bytes += v->frame_bytes;
+        v->frames++;
+    }
+}
+
+size_t last_top(struct text *text, int height) {
+    while (text_index_step(text, INDEX_STEP)) {
+    }
+    return text->nlines > (size_t)height ? text->nlines - height : 0;
 }
 
-void update(WINDOW *win, FILE *file, int width, char *buffer) {
-    if (!fgets(buffer, BUFFER_SIZE, file)) {
+/* Read a line typed after `prompt` on the bottom border, 0 if cancelled */
+int read_prompt(struct view *v, char prompt, char *buf, size_t size) {
+    int row = getmaxy(v->screen) - 1;
+    size_t n = 0;
+    int c;
+    buf[0] = '\0';
+    wtimeout(v->win, -1);
+    mvwhline(v->screen, row, 1, ACS_HLINE, getmaxx(v->screen) - 2);
+    for (;;) {
+        mvwprintw(v->screen, row, 2, "%c%s ", prompt, buf);
+        wrefresh(v->screen);
+        c = wgetch(v->win);
+        if (c == '\n' || c == KEY_ENTER) {
+            break;
+        } else if (c == 27) {
+            n = 0;
+            buf[0] = '\0';
+            break;
+        } else if ((c == KEY_BACKSPACE || c == 127 || c == 8) && n > 0) {
+            buf[--n] = '\0';
+        } else if (c >= 32 && c < 256 && c != 127 && n < size - 1) {
+            buf[n++] = c;
+            buf[n] = '\0';
+        }
+    }
+    wtimeout(v->win, 0);
+    v->status[0] = '\0';
+    return n > 0;
+}
+
+/* Look for the next (dir > 0) or previous match relative to the last one found,
+ * or to the top line if that one has been scrolled away */
+void search_next(struct view *v, int dir) {
+    size_t line = v->top, len;
+    if (v->match_line != NO_MATCH && v->match_line >= v->top && v->match_line < v->top + v->height) {
+        line = v->match_line;
+    }
+    line += dir > 0;
+    const char *str = text_line(v->text, line, &len);
+    if (!v->search->active || (!str && dir > 0)) {
+        v->message = v->search->active ? "Pattern not found " : NULL;
+        return;
+    }
+    search_request(v->search, str ? v->text->cur_off : v->text->size, dir);
+    v->message = "Searching... ";
+}
+
+void search_done(struct view *v) {
+    size_t found;
+    if (!search_result(v->search, &found)) {
+        return;
+    }
+    if (found == NO_MATCH) {
+        v->message = "Pattern not found ";
         return;
     }
-    shrink_str(buffer, width);
-    wprintw(win, "%s\n", buffer);
-    wrefresh(win);
+    v->message = NULL;
+    v->match_line = text_line_of(v->text, found);
+    v->top = text_has_line(v->text, v->match_line + v->height - 1) ? v->match_line
+                                                                  : last_top(v->text, v->height);
+}
+
+/* Only moves the view; the next render() works out what to repaint */
+void handle_key(struct view *v, int c) {
+    size_t old_top = v->top, line_no;
+    char input[BUFFER_SIZE];
+    v->message = NULL;
+    switch (c) {
+    case 32:
+    case KEY_DOWN:
+        update(v, 1);
+        break;
+    case KEY_UP:
+        update(v, -1);
+        break;
+    case KEY_NPAGE:
+        v->top = text_has_line(v->text, v->top + 2 * v->height - 1) ? v->top + v->height
+                                                                    : last_top(v->text, v->height);
+        v->top = MAX(v->top, old_top);
+        break;
+    case KEY_RIGHT:
+        v->left += v->width / 2;
+        display_page(v);
+        break;
+    case KEY_LEFT:
+        v->left -= MIN(v->left, (size_t)v->width / 2);
+        display_page(v);
+        break;
+    case KEY_PPAGE:
+        v->top = v->top > (size_t)v->height ? v->top - v->height : 0;
+        break;
+    case KEY_HOME:
+    case 'g':
+        v->top = 0;
+        break;
+    case KEY_END:
+    case 'G':
+        v->top = last_top(v->text, v->height);
+        break;
+    case '/':
+        if (read_prompt(v, '/', input, sizeof(input))) {
+            v->message = search_set(v->search, input);
+            v->match_line = NO_MATCH;
+            display_page(v);
+            if (!v->message) {
+                search_next(v, 1);
+            }
+        }
+        break;
+    case 'n':
+        search_next(v, 1);
+        break;
+    case 'N':
+        search_next(v, -1);
+        break;
+    case ':':
+        if (read_prompt(v, ':', input, sizeof(input)) && (line_no = strtoull(input, NULL, 10)) > 0) {
+            v->top = text_has_line(v->text, line_no - 1 + v->height) ? line_no - 1
+                                                                    : last_top(v->text, v->height);
+        }
+        break;
+    }
+}
+
+/* New data arrived: if the end of the file was on screen, scroll the new lines in,
+ * otherwise just leave the view where the user put it */
+void follow_update(struct view *v, size_t old_nlines) {
+    size_t old_last = old_nlines > (size_t)v->height ? old_nlines - v->height : 0;
+    if (v->top < old_last) {
+        return;
+    }
+    v->top = last_top(v->text, v->height);
+    /* the previously last line may have been incomplete, so redraw it and below */
+    long from = old_nlines > 0 ? (long)(old_nlines - 1) - (long)v->top : 0;
+    damage(v, MAX(from, 0), v->height);
+}
+
+/* inotify watches on the file and on its directory, to notice rotation */
+struct follow {
+    int fd;
+    int wd_file;
+    int wd_dir;
+    const char *path;
+    char *name;
+    char *dir;
+};
+
+int follow_init(struct follow *f, const char *path) {
+    char *tmp = strdup(path);
+    f->path = path;
+    f->name = tmp ? strdup(basename(tmp)) : NULL;
+    f->dir = tmp ? strdup(dirname(strcpy(tmp, path))) : NULL;
+    free(tmp);
+    f->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (f->fd < 0 || !f->name || !f->dir) {
+        return -1;
+    }
+    f->wd_file = inotify_add_watch(f->fd, path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    f->wd_dir = inotify_add_watch(f->fd, f->dir, IN_CREATE | IN_MOVED_TO);
+    return f->wd_file < 0 ? -1 : 0;
+}
+
+void follow_close(struct follow *f) {
+    close(f->fd);
+    free(f->name);
+    free(f->dir);
+}
+
+/* Drain inotify events; returns 1 if the file grew, 2 if it must be reopened */
+int follow_events(struct follow *f, struct text *text) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int grew = 0, reopen = 0;
+    ssize_t len;
+    while ((len = read(f->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->wd == f->wd_file && (ev->mask & IN_MODIFY)) {
+                grew = 1;
+            } else if (ev->wd == f->wd_dir && ev->len && strcmp(ev->name, f->name) == 0) {
+                reopen = 1;
+            }
+        }
+    }
+    if (reopen) {
+        inotify_rm_watch(f->fd, f->wd_file);
+        f->wd_file = inotify_add_watch(f->fd, f->path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+        return 2;
+    }
+    if (grew) {
+        int res = text_reload(text);
+        return res < 0 ? 2 : res;
+    }
+    return 0;
 }
 
 
 
 int main(int argc, char *argv[]){
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <filename>\n", argv[0]);
+    int follow = 0, stats = 0, opt;
+    while ((opt = getopt(argc, argv, "fs")) != -1) {
+        if (opt == 'f') {
+            follow = 1;
+        } else if (opt == 's') {
+            stats = 1;
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-f] [-s] <filename>\n", argv[0]);
+        return 1;
+    }
+    const char *filename = argv[optind];
+    struct text text;
+    struct follow watch;
+    struct search search;
+
+    if (text_open(&text, filename) < 0) {
+        fprintf(stderr, "Error opening file: %s\n", filename);
+        return 1;
+    }
+    if (search_init(&search, &text) < 0) {
+        fprintf(stderr, "Error starting search\n");
+        text_close(&text);
+        return 1;
+    }
+    follow = follow && text.mapped;
+    if (follow && follow_init(&watch, filename) < 0) {
+        fprintf(stderr, "Error watching file: %s\n", filename);
+        text_close(&text);
         return 1;
     }
-    WINDOW *screen, *win;
 
     setlocale(LC_ALL, "");
     initscr();
@@ -77,38 +1365,123 @@ int main(int argc, char *argv[]){
     cbreak();
     refresh();
 
-    screen = newwin(LINES - 2*DY, COLS - 2*DX, DY, DX);
-    draw_border(screen, argv[1]);
+    struct view v = {0};
+    v.text = &text;
+    v.search = &search;
+    v.match_line = NO_MATCH;
+    v.screen = newwin(LINES - 2*DY, COLS - 2*DX, DY, DX);
+    draw_border(v.screen, filename);
 
-    win = newwin(LINES - 2*DY - 2, COLS - 2*DX-2, DY+1, DX+1);
-    int height = getmaxy(win);
-    int width = getmaxx(win);
+    v.win = newwin(LINES - 2*DY - 2, COLS - 2*DX-2, DY+1, DX+1);
+    v.height = getmaxy(v.win);
+    v.width = getmaxx(v.win);
+    v.damage = calloc(v.height, 1);
+    v.row_buf = malloc(v.width * 8 + 8);
+    v.widths = calloc(WIDTH_CACHE, sizeof(*v.widths));
+    v.follow = follow;
+    v.stats = stats;
+    v.io_fd = stats ? open("/proc/self/io", O_RDONLY | O_CLOEXEC) : -1;
 
-    FILE *file = fopen(argv[1], "r");
-    if (file == NULL) {
-        delwin(win);
-        delwin(screen);
-        endwin();
-        fprintf(stderr, "Error opening file: %s\n", argv[1]);
-        return 1;
+    idlok(v.win, TRUE);
+    if (follow) {
+        v.top = last_top(&text, v.height);
     }
+    display_page(&v);
+    render(&v);
+    keypad(v.win, TRUE);
+    wtimeout(v.win, 0);
 
-    int line_cnt = 0;
-    char buffer[BUFFER_SIZE] = {0};
-    int c = 0;
+    /* sleep in epoll until a key or a file change arrives; poll only while indexing */
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = STDIN_FILENO};
+    epoll_ctl(ep, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+    ev.data.fd = search.efd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, search.efd, &ev);
+    if (follow) {
+        ev.data.fd = watch.fd;
+        epoll_ctl(ep, EPOLL_CTL_ADD, watch.fd, &ev);
+    }
 
-    line_cnt = display_first_page(win, file, height, width, buffer);
-    keypad(win, TRUE);
-    while((c = wgetch(win)) != 27) {
-        if (c == 32) {
-            update(win, file, width, buffer);
-            line_cnt++;
+    int c = 0, running = 1;
+    while (running) {
+        struct epoll_event events[3];
+        int n = epoll_wait(ep, events, 3, text_indexed(&text) ? -1 : 0);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        if (n == 0) {
+            text_index_step(&text, INDEX_STEP);
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == search.efd) {
+                search_done(&v);
+            } else if (follow && events[i].data.fd == watch.fd) {
+                size_t old_nlines = text.nlines;
+                pthread_mutex_lock(&search.lock);
+                int res = follow_events(&watch, &text);
+                if (res == 2) {
+                    /* the old data stays on screen until the new file opens
+                     * as a plain mapped file, so follow mode can go on */
+                    struct text fresh;
+                    int opened = text_open(&fresh, filename) == 0;
+                    if (opened && fresh.mapped) {
+                        search.gen++;
+                        if (search.reader) {
+                            gz_free(search.reader);
+                            search.reader = NULL;
+                        }
+                        text_close(&text);
+                        text = fresh;
+                        v.message = NULL;
+                    } else {
+                        if (opened) {
+                            text_close(&fresh);
+                        }
+                        v.message = "Cannot reopen file ";
+                        res = 0;
+                    }
+                }
+                pthread_mutex_unlock(&search.lock);
+                if (res == 1) {
+                    follow_update(&v, old_nlines);
+                } else if (res == 2) {
+                    v.top = last_top(&text, v.height);
+                    v.match_line = NO_MATCH;
+                    widths_reset(&v);
+                    display_page(&v);
+                }
+            }
         }
+        while (running && (c = wgetch(v.win)) != ERR) {
+            if (c == 27) {
+                running = 0;
+            } else {
+                handle_key(&v, c);
+            }
+        }
+        /* a burst of keys (e.g. held space) is drained above and drawn as one frame */
+        render(&v);
     }
 
-    delwin(win);
-    delwin(screen);
+    close(ep);
+    search_close(&search);
+    if (follow) {
+        follow_close(&watch);
+    }
+    delwin(v.win);
+    delwin(v.screen);
     endwin();
-    fclose(file);
+    if (stats) {
+        close(v.io_fd);
+        fprintf(stderr, "%zu frames, %zu bytes to tty, %.1f bytes/frame\n", v.frames,
+                v.total_bytes, v.frames ? (double)v.total_bytes / v.frames : 0.0);
+    }
+    for (int i = 0; i < WIDTH_CACHE; i++) {
+        free(v.widths[i].stops);
+    }
+    free(v.widths);
+    free(v.row_buf);
+    free(v.damage);
+    text_close(&text);
     return 0;
 }
@@ -0,0 +1,29 @@
+#define main show_main
+#include "Show.c"
+#undef main
+
+/* Searches `text` for `pattern`; prints OK if the first matching line starts at `expected` */
+int check(const char *pattern, const char *text, size_t expected) {
+    struct search s = {0};
+    pthread_mutex_init(&s.lock, NULL);
+    const char *error = search_set(&s, pattern);
+    size_t found = error ? NO_MATCH : search_range(&s, text, strlen(text));
+    printf("%s %s\n", found == expected ? "OK" : "WA", pattern);
+    if (s.active && s.is_regex) {
+        regfree(&s.re);
+    }
+    pthread_mutex_destroy(&s.lock);
+    return found != expected;
+}
+
+int main(void) {
+    const char *text = "no digits here\nvalue 42x\n]x and a-z\n";
+    int fail = 0;
+    fail |= check("value", text, 15);
+    fail |= check("[[:digit:]]x", text, 15);
+    fail |= check("[]]x", text, 25);
+    fail |= check("[^]a]x", text, 15);
+    fail |= check("[[.-.]]z", text, 25);
+    fail |= check("[[:alpha:]]{3}q", text, NO_MATCH);
+    return fail;
+}
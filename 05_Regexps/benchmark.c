@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+const char* NAMES[] = {"Alice", "Bob", "Carol", "Dave"};
+const char* METHODS[] = {"GET", "POST", "PUT"};
+const char* WORDS[] = {"cat", "dog", "bird", "fish", "on", "roof", "black", "path", "with", "slash"};
+
+// Deterministic, so a size always gives the same corpus
+unsigned long long next_random(unsigned long long* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int pick(unsigned long long r, int shift, int count) {
+    return (r >> shift) % count;
+}
+
+// Log-like lines with what the tests look for: dates, IPs, names, cats and dogs
+int make_corpus(long megabytes, const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Error: cannot create %s\n", path);
+        return 1;
+    }
+    unsigned long long state = 88172645463325252ULL;
+    long long size = megabytes << 20, written = 0;
+    while (written < size) {
+        unsigned long long r = next_random(&state);
+        int n = fprintf(f, "%02d/%02d/%04d %02d:%02d:%02d %s %d.%d.%d.%d %s /%s/%s",
+                        pick(r, 0, 28) + 1, pick(r, 8, 12) + 1, 2000 + pick(r, 12, 30), pick(r, 20, 24),
+                        pick(r, 24, 60), pick(r, 30, 60), NAMES[pick(r, 36, 4)], pick(r, 40, 256),
+                        pick(r, 44, 256), pick(r, 48, 256), pick(r, 52, 256), METHODS[pick(r, 58, 3)],
+                        WORDS[pick(r, 4, 10)], WORDS[pick(r, 16, 10)]);
+        r = next_random(&state);
+        for (int words = r % 6; words > 0; words--, r >>= 4) {
+            n += fprintf(f, " %s", WORDS[pick(r, 0, 10)]);
+        }
+        n += fprintf(f, " took %dms\n", pick(r, 0, 1000));
+        written += n;
+    }
+    return fclose(f) != 0;
+}
+
+// Runs the command `runs` times with its output thrown away and prints one
+// JSON line: the fastest run and the largest resident set of all of them
+int run(const char* tool, const char* pattern, const char* path, long matches, int runs, char** argv) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "Error: cannot stat %s\n", path);
+        return 1;
+    }
+    double best = -1;
+    long max_rss = 0;
+    for (int i = 0; i < runs; i++) {
+        struct timespec start, end;
+        struct rusage usage;
+        int status;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pid_t pid = fork();
+        if (pid == 0) {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+            execvp(argv[0], argv);
+            _exit(127);
+        } else if (pid < 0 || wait4(pid, &status, 0, &usage) < 0) {
+            fprintf(stderr, "Error: cannot run %s\n", argv[0]);
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Error: %s failed\n", argv[0]);
+            return 1;
+        }
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (best < 0 || seconds < best) {
+            best = seconds;
+        }
+        if (usage.ru_maxrss > max_rss) {
+            max_rss = usage.ru_maxrss;
+        }
+    }
+    printf("{\"tool\": \"%s\", \"pattern\": \"%s\", \"bytes\": %lld, \"matches\": %ld, \"seconds\": %.4f, "
+           "\"mb_per_s\": %.1f, \"ns_per_match\": %.1f, \"max_rss_kb\": %ld}\n",
+           tool, pattern, (long long)st.st_size, matches, best, st.st_size / 1048576.0 / best,
+           matches > 0 ? best * 1e9 / matches : 0.0, max_rss);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 4 && strcmp(argv[1], "corpus") == 0) {
+        return make_corpus(atol(argv[2]), argv[3]);
+    } else if (argc > 8 && strcmp(argv[1], "run") == 0 && strcmp(argv[7], "--") == 0) {
+        return run(argv[2], argv[3], argv[4], atol(argv[5]), atoi(argv[6]), argv + 8);
+    }
+    fprintf(stderr, "Usage: benchmark corpus MEGABYTES FILE\n");
+    fprintf(stderr, "       benchmark run TOOL PATTERN FILE MATCHES RUNS -- command [args...]\n");
+    return 1;
+}
@@ -0,0 +1,829 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include "dfa.h"
+
+#define MAX_PROGRAM 20000
+#define MAX_REPEAT 0x7fff
+#define DFA_STATES 4096
+#define MARK (-1)
+
+// Parsed regexp. Children are indices into the node array.
+enum node_type { N_EMPTY, N_SET, N_BOL, N_EOL, N_GROUP, N_CAT, N_ALT, N_REPEAT };
+
+struct node {
+    enum node_type type;
+    int left, right;
+    int arg;        // set for N_SET, group number for N_GROUP, minimum for N_REPEAT
+    int max;        // maximum for N_REPEAT, -1 if unbounded
+};
+
+struct charset {
+    uint64_t bits[4];
+};
+
+// Thompson NFA program
+enum inst_op { I_SET, I_SPLIT, I_JMP, I_SAVE, I_BOL, I_EOL, I_MATCH };
+
+struct inst {
+    enum inst_op op;
+    int x, y;       // set, jump targets (x preferred) or capture slot
+};
+
+struct program {
+    struct inst* code;
+    int len;
+};
+
+// Lazily built DFA. A state is the list of live NFA threads: SET and MATCH
+// instructions and EOL assertions waiting for the end of text. When searching
+// unanchored, MARKs split the list into classes of threads that started at the
+// same position, earliest first; a thread reached from an earlier start shadows
+// the same thread from a later one. Once a class matches, the later classes are
+// dropped and no new ones start, so the last match seen is the leftmost-longest.
+// S_BOL marks the start state at the beginning of text, where a ^ after $ holds.
+enum { S_MATCH = 1, S_MATCHED = 2, S_DEAD = 4, S_BOL = 8 };
+
+struct state {
+    int* pcs;
+    int len;
+    int flags;
+    int next[257];  // by byte, 256 is the end of text; -1 if not built yet
+};
+
+struct dfa {
+    const struct program* prog;
+    const struct charset* sets;
+    int anchored;
+    struct state* states;
+    int nstates;
+    unsigned resets;
+    int* table;     // open addressing, state index + 1
+    int start[2];   // without and with BOL allowed
+    int* list;
+    int* stack;
+    unsigned* seen;
+    unsigned gen;
+};
+
+// Pike VM, used only to fill in groups of a match the DFA has already found
+struct frame {
+    int pc;
+    int slot;       // -1 to visit pc, otherwise restore caps[slot] = value
+    long value;
+};
+
+struct threads {
+    int* pcs;
+    long* caps;
+    int n;
+};
+
+struct pike {
+    int ncaps;
+    int active;
+    struct threads lists[2];
+    long* scratch;
+    struct frame* stack;
+    unsigned* seen;
+    unsigned gen;
+};
+
+struct dfa_regex {
+    struct node* nodes;
+    int nnodes;
+    struct charset* sets;
+    int nsets;
+    size_t ngroups;
+    struct program forward;
+    struct program reverse;     // matches the reversed text, to find where a match starts
+    struct dfa fwd;
+    struct dfa rev;
+    struct pike vm;
+};
+
+struct parser {
+    const char* p;
+    const char* end;
+    struct dfa_regex* re;
+    const char* error;
+};
+
+static int fail(struct parser* ps, const char* error) {
+    if (!ps->error) {
+        ps->error = error;
+    }
+    return -1;
+}
+
+static int new_node(struct parser* ps, enum node_type type, int left, int right, int arg, int max) {
+    struct dfa_regex* re = ps->re;
+    if (left < 0 || right < 0) {
+        return -1;
+    }
+    if ((re->nnodes & (re->nnodes - 1)) == 0) {
+        struct node* nodes = realloc(re->nodes, (re->nnodes ? re->nnodes * 2 : 16) * sizeof(*nodes));
+        if (!nodes) {
+            return fail(ps, "Memory exhausted");
+        }
+        re->nodes = nodes;
+    }
+    re->nodes[re->nnodes] = (struct node){type, left, right, arg, max};
+    return re->nnodes++;
+}
+
+static int new_set(struct parser* ps) {
+    struct dfa_regex* re = ps->re;
+    if ((re->nsets & (re->nsets - 1)) == 0) {
+        struct charset* sets = realloc(re->sets, (re->nsets ? re->nsets * 2 : 16) * sizeof(*sets));
+        if (!sets) {
+            return fail(ps, "Memory exhausted");
+        }
+        re->sets = sets;
+    }
+    memset(&re->sets[re->nsets], 0, sizeof(*re->sets));
+    return re->nsets++;
+}
+
+static void set_add(struct charset* set, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) {
+        set->bits[c >> 6] |= 1ULL << (c & 63);
+    }
+}
+
+static int set_has(const struct charset* set, int c) {
+    return (set->bits[c >> 6] >> (c & 63)) & 1;
+}
+
+static int char_node(struct parser* ps, int lo, int hi) {
+    int set = new_set(ps);
+    if (set >= 0) {
+        set_add(&ps->re->sets[set], lo, hi);
+    }
+    return new_node(ps, N_SET, 0, 0, set, 0);
+}
+
+static int class_node(struct parser* ps, int (*is_class)(int), int negate) {
+    int set = new_set(ps);
+    for (int c = 0; set >= 0 && c < 256; c++) {
+        if ((is_class(c) != 0) != negate) {
+            set_add(&ps->re->sets[set], c, c);
+        }
+    }
+    return new_node(ps, N_SET, 0, 0, set, 0);
+}
+
+static int is_word(int c) {
+    return isalnum(c) || c == '_';
+}
+
+static const struct {
+    const char* name;
+    int (*is_class)(int);
+} CLASSES[] = {
+    {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum}, {"upper", isupper},
+    {"lower", islower}, {"space", isspace}, {"blank", isblank}, {"punct", ispunct},
+    {"print", isprint}, {"graph", isgraph}, {"cntrl", iscntrl}, {"xdigit", isxdigit},
+};
+
+// One character of a bracket expression, also as [.c.] or [=c=]
+static int bracket_char(struct parser* ps) {
+    if (ps->p[0] == '[' && ps->end - ps->p >= 2 && (ps->p[1] == '.' || ps->p[1] == '=')) {
+        if (ps->end - ps->p < 5 || ps->p[3] != ps->p[1] || ps->p[4] != ']') {
+            return fail(ps, "Invalid collation character");
+        }
+        ps->p += 5;
+        return (unsigned char)ps->p[-3];
+    }
+    return (unsigned char)*ps->p++;
+}
+
+static int parse_bracket(struct parser* ps) {
+    int set = new_set(ps);
+    if (set < 0) {
+        return -1;
+    }
+    int negate = ps->p < ps->end && *ps->p == '^';
+    ps->p += negate;
+    for (int first = 1;; first = 0) {
+        if (ps->p >= ps->end) {
+            return fail(ps, "Unmatched [, [^, [:, [., or [=");
+        }
+        if (*ps->p == ']' && !first) {
+            ps->p++;
+            break;
+        }
+        if (ps->p[0] == '[' && ps->end - ps->p >= 2 && ps->p[1] == ':') {
+            const char* name = ps->p + 2;
+            const char* close = name;
+            while (close + 1 < ps->end && !(close[0] == ':' && close[1] == ']')) {
+                close++;
+            }
+            if (close + 1 >= ps->end) {
+                return fail(ps, "Unmatched [, [^, [:, [., or [=");
+            }
+            size_t i = 0, count = sizeof(CLASSES) / sizeof(CLASSES[0]);
+            while (i < count && (strlen(CLASSES[i].name) != (size_t)(close - name) ||
+                                 strncmp(CLASSES[i].name, name, close - name) != 0)) {
+                i++;
+            }
+            if (i == count) {
+                return fail(ps, "Invalid character class name");
+            }
+            for (int c = 0; c < 256; c++) {
+                if (CLASSES[i].is_class(c)) {
+                    set_add(&ps->re->sets[set], c, c);
+                }
+            }
+            ps->p = close + 2;
+            continue;
+        }
+        int lo = bracket_char(ps), hi = lo;
+        if (lo >= 0 && ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+            ps->p++;
+            if ((hi = bracket_char(ps)) >= 0 && hi < lo) {
+                return fail(ps, "Invalid range end");
+            }
+        }
+        if (lo < 0 || hi < 0) {
+            return -1;
+        }
+        set_add(&ps->re->sets[set], lo, hi);
+    }
+    if (negate) {
+        for (int i = 0; i < 4; i++) {
+            ps->re->sets[set].bits[i] = ~ps->re->sets[set].bits[i];
+        }
+    }
+    return new_node(ps, N_SET, 0, 0, set, 0);
+}
+
+static int parse_escape(struct parser* ps) {
+    if (ps->p == ps->end) {
+        return fail(ps, "Trailing backslash");
+    }
+    unsigned char c = *ps->p++;
+    if (c >= '1' && c <= '9') {
+        return fail(ps, "Back-references need the posix engine");
+    } else if (strchr("bB<>`'", c)) {
+        return fail(ps, "Word and buffer anchors need the posix engine");
+    } else if (c == 'w' || c == 'W') {
+        return class_node(ps, is_word, c == 'W');
+    } else if (c == 's' || c == 'S') {
+        return class_node(ps, isspace, c == 'S');
+    }
+    return char_node(ps, c, c);
+}
+
+static int parse_number(struct parser* ps) {
+    int value = -1;
+    while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+        value = (value < 0 ? 0 : value * 10) + (*ps->p++ - '0');
+        if (value > MAX_REPEAT) {
+            return fail(ps, "Regular expression too big");
+        }
+    }
+    return value;
+}
+
+// {m}, {m,}, {m,n} or {,n}, after the opening brace
+static int parse_interval(struct parser* ps, int* min, int* max) {
+    *min = parse_number(ps);
+    *max = *min;
+    if (ps->error) {
+        return -1;
+    }
+    if (ps->p < ps->end && *ps->p == ',') {
+        ps->p++;
+        *max = parse_number(ps);
+        if (ps->error) {
+            return -1;
+        }
+        *min = *min < 0 ? 0 : *min;
+    } else if (*min < 0) {
+        return fail(ps, ps->p < ps->end && *ps->p == '}' ? "Invalid content of \\{\\}" : "Unmatched \\{");
+    }
+    if (ps->p == ps->end || *ps->p != '}') {
+        return fail(ps, "Unmatched \\{");
+    }
+    ps->p++;
+    if (*max >= 0 && *max < *min) {
+        return fail(ps, "Invalid content of \\{\\}");
+    }
+    return 0;
+}
+
+static int parse_alt(struct parser* ps);
+
+static int parse_atom(struct parser* ps) {
+    char c = *ps->p++;
+    if (c == '(') {
+        int group = ++ps->re->ngroups;
+        int body = parse_alt(ps);
+        if (body >= 0 && (ps->p == ps->end || *ps->p != ')')) {
+            return fail(ps, "Unmatched ( or \\(");
+        }
+        ps->p++;
+        return new_node(ps, N_GROUP, body, 0, group, 0);
+    } else if (c == '.') {
+        return char_node(ps, 0, 255);
+    } else if (c == '[') {
+        return parse_bracket(ps);
+    } else if (c == '^' || c == '$') {
+        return new_node(ps, c == '^' ? N_BOL : N_EOL, 0, 0, 0, 0);
+    } else if (c == '\\') {
+        return parse_escape(ps);
+    }
+    return char_node(ps, (unsigned char)c, (unsigned char)c);
+}
+
+static int parse_piece(struct parser* ps) {
+    if (strchr("*+?{", *ps->p)) {
+        return fail(ps, "Invalid preceding regular expression");
+    }
+    int atom = parse_atom(ps);
+    while (atom >= 0 && ps->p < ps->end && strchr("*+?{", *ps->p)) {
+        int min = 0, max = -1;
+        char c = *ps->p++;
+        if (ps->re->nodes[atom].type == N_BOL || ps->re->nodes[atom].type == N_EOL) {
+            return fail(ps, "Invalid preceding regular expression");
+        } else if (c == '+') {
+            min = 1;
+        } else if (c == '?') {
+            max = 1;
+        } else if (c == '{' && parse_interval(ps, &min, &max) != 0) {
+            return -1;
+        }
+        atom = new_node(ps, N_REPEAT, atom, 0, min, max);
+    }
+    return atom;
+}
+
+static int parse_concat(struct parser* ps) {
+    int result = new_node(ps, N_EMPTY, 0, 0, 0, 0);
+    while (result >= 0 && ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        result = new_node(ps, N_CAT, result, parse_piece(ps), 0, 0);
+    }
+    return result;
+}
+
+static int parse_alt(struct parser* ps) {
+    int left = parse_concat(ps);
+    while (left >= 0 && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        left = new_node(ps, N_ALT, left, parse_concat(ps), 0, 0);
+    }
+    return left;
+}
+
+static int emit(struct program* prog, enum inst_op op, int x, int y) {
+    if (prog->len == MAX_PROGRAM) {
+        return -1;
+    }
+    prog->code[prog->len] = (struct inst){op, x, y};
+    return prog->len++;
+}
+
+// The reversed program reads the text backwards: concatenations are reversed,
+// ^ and $ swap places and groups are not recorded
+static int emit_node(const struct dfa_regex* re, struct program* prog, int n, int reverse) {
+    const struct node* node = &re->nodes[n];
+    int at, chain = -1;
+    switch (node->type) {
+    case N_EMPTY:
+        return 0;
+    case N_SET:
+        return emit(prog, I_SET, node->arg, 0) < 0 ? -1 : 0;
+    case N_BOL:
+    case N_EOL:
+        return emit(prog, (node->type == N_BOL) != reverse ? I_BOL : I_EOL, 0, 0) < 0 ? -1 : 0;
+    case N_GROUP:
+        if (reverse) {
+            return emit_node(re, prog, node->left, reverse);
+        }
+        if (emit(prog, I_SAVE, 2 * node->arg, 0) < 0 || emit_node(re, prog, node->left, reverse) < 0) {
+            return -1;
+        }
+        return emit(prog, I_SAVE, 2 * node->arg + 1, 0) < 0 ? -1 : 0;
+    case N_CAT:
+        if (emit_node(re, prog, reverse ? node->right : node->left, reverse) < 0) {
+            return -1;
+        }
+        return emit_node(re, prog, reverse ? node->left : node->right, reverse);
+    case N_ALT:
+        if ((at = emit(prog, I_SPLIT, prog->len + 1, 0)) < 0 || emit_node(re, prog, node->left, reverse) < 0 ||
+            (chain = emit(prog, I_JMP, 0, 0)) < 0) {
+            return -1;
+        }
+        prog->code[at].y = prog->len;
+        if (emit_node(re, prog, node->right, reverse) < 0) {
+            return -1;
+        }
+        prog->code[chain].x = prog->len;
+        return 0;
+    case N_REPEAT:
+        for (int i = 0; i < node->arg; i++) {
+            if (emit_node(re, prog, node->left, reverse) < 0) {
+                return -1;
+            }
+        }
+        if (node->max < 0) {
+            if ((at = emit(prog, I_SPLIT, prog->len + 1, 0)) < 0 || emit_node(re, prog, node->left, reverse) < 0 ||
+                emit(prog, I_JMP, at, 0) < 0) {
+                return -1;
+            }
+            prog->code[at].y = prog->len;
+            return 0;
+        }
+        // Optional copies; the skip targets are chained through y until the end is known
+        for (int i = node->arg; i < node->max; i++) {
+            if ((at = emit(prog, I_SPLIT, prog->len + 1, chain)) < 0 || emit_node(re, prog, node->left, reverse) < 0) {
+                return -1;
+            }
+            chain = at;
+        }
+        while (chain >= 0) {
+            at = prog->code[chain].y;
+            prog->code[chain].y = prog->len;
+            chain = at;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static unsigned next_gen(unsigned* gen, unsigned* seen, int len) {
+    if (++*gen == 0) {
+        memset(seen, 0, len * sizeof(*seen));
+        *gen = 1;
+    }
+    return *gen;
+}
+
+static void dfa_reset(struct dfa* d) {
+    for (int i = 0; i < d->nstates; i++) {
+        free(d->states[i].pcs);
+    }
+    d->nstates = 0;
+    d->resets++;
+    memset(d->table, 0, 2 * DFA_STATES * sizeof(*d->table));
+    d->start[0] = d->start[1] = -1;
+}
+
+static int dfa_init(struct dfa* d, const struct program* prog, const struct charset* sets, int anchored) {
+    memset(d, 0, sizeof(*d));
+    d->prog = prog;
+    d->sets = sets;
+    d->anchored = anchored;
+    d->start[0] = d->start[1] = -1;
+    d->states = malloc(DFA_STATES * sizeof(*d->states));
+    d->table = calloc(2 * DFA_STATES, sizeof(*d->table));
+    d->list = malloc((2 * prog->len + 1) * sizeof(*d->list));
+    d->stack = malloc(prog->len * sizeof(*d->stack));
+    d->seen = calloc(prog->len, sizeof(*d->seen));
+    return d->states && d->table && d->list && d->stack && d->seen ? 0 : -1;
+}
+
+static void dfa_destroy(struct dfa* d) {
+    if (d->states && d->table) {
+        dfa_reset(d);
+    }
+    free(d->states);
+    free(d->table);
+    free(d->list);
+    free(d->stack);
+    free(d->seen);
+}
+
+// Appends to d->list the threads reachable from pc without reading input.
+// Returns 1 if one of them is a match.
+static int dfa_closure(struct dfa* d, int pc, int bol, int eol, int* len) {
+    int sp = 0, match = 0;
+    d->stack[sp++] = pc;
+    while (sp > 0) {
+        pc = d->stack[--sp];
+        while (d->seen[pc] != d->gen) {
+            const struct inst* in = &d->prog->code[pc];
+            d->seen[pc] = d->gen;
+            if (in->op == I_JMP) {
+                pc = in->x;
+            } else if (in->op == I_SPLIT) {
+                d->stack[sp++] = in->y;
+                pc = in->x;
+            } else if (in->op == I_SAVE || (in->op == I_BOL && bol) || (in->op == I_EOL && eol)) {
+                pc++;
+            } else if (in->op != I_BOL) {
+                match |= in->op == I_MATCH;
+                d->list[(*len)++] = pc;
+            }
+        }
+    }
+    return match;
+}
+
+// The state with the threads in d->list, added if it is new. A full cache is
+// thrown away, which invalidates every state index held by the caller.
+static int dfa_state(struct dfa* d, int len, int flags) {
+    unsigned hash = 2166136261u ^ flags;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned)d->list[i]) * 16777619u;
+    }
+    if (len == 0 && (d->anchored || (flags & S_MATCHED))) {
+        flags |= S_DEAD;
+    }
+    unsigned mask = 2 * DFA_STATES - 1, i = hash & mask;
+    for (; d->table[i]; i = (i + 1) & mask) {
+        const struct state* s = &d->states[d->table[i] - 1];
+        if (s->flags == flags && s->len == len && memcmp(s->pcs, d->list, len * sizeof(*d->list)) == 0) {
+            return d->table[i] - 1;
+        }
+    }
+    if (d->nstates == DFA_STATES) {
+        dfa_reset(d);
+        i = hash & mask;
+    }
+    struct state* s = &d->states[d->nstates];
+    if (!(s->pcs = malloc((len + 1) * sizeof(*s->pcs)))) {
+        return -1;
+    }
+    memcpy(s->pcs, d->list, len * sizeof(*d->list));
+    s->len = len;
+    s->flags = flags;
+    memset(s->next, -1, sizeof(s->next));
+    d->table[i] = d->nstates + 1;
+    return d->nstates++;
+}
+
+static int dfa_start(struct dfa* d, int bol) {
+    if (d->start[bol] < 0) {
+        int len = 0;
+        next_gen(&d->gen, d->seen, d->prog->len);
+        int flags = (dfa_closure(d, 0, bol, 0, &len) ? S_MATCH | S_MATCHED : 0) | (bol ? S_BOL : 0);
+        int s = dfa_state(d, len, flags);
+        d->start[bol] = s;
+    }
+    return d->start[bol];
+}
+
+// Moves state s over `byte`, or over the end of text when it is 256
+static int dfa_next(struct dfa* d, int s, int byte) {
+    const struct state* from = &d->states[s];
+    int len = 0, flags = from->flags & S_MATCHED, i = 0;
+    unsigned resets = d->resets;
+    next_gen(&d->gen, d->seen, d->prog->len);
+    while (i < from->len && !(flags & S_MATCH)) {
+        int begin = len, match = 0;
+        if (len > 0) {
+            d->list[len++] = MARK;
+        }
+        for (; i < from->len && from->pcs[i] != MARK; i++) {
+            const struct inst* in = &d->prog->code[from->pcs[i]];
+            if (byte < 256 && in->op == I_SET && set_has(&d->sets[in->x], byte)) {
+                match |= dfa_closure(d, from->pcs[i] + 1, 0, 0, &len);
+            } else if (byte == 256 && in->op == I_EOL) {
+                match |= dfa_closure(d, from->pcs[i] + 1, (from->flags & S_BOL) != 0, 1, &len);
+            }
+        }
+        i++;
+        if (len == begin + (begin > 0)) {
+            len = begin;
+        }
+        if (match) {
+            flags |= S_MATCH | S_MATCHED;
+        }
+    }
+    if (!d->anchored && !(flags & S_MATCHED) && byte < 256) {
+        int begin = len;
+        if (len > 0) {
+            d->list[len++] = MARK;
+        }
+        if (dfa_closure(d, 0, 0, 0, &len)) {
+            flags |= S_MATCH | S_MATCHED;
+        }
+        if (len == begin + (begin > 0)) {
+            len = begin;
+        }
+    }
+    int next = dfa_state(d, len, flags);
+    if (next >= 0 && d->resets == resets) {
+        d->states[s].next[byte] = next;
+    }
+    return next;
+}
+
+static int pike_init(struct pike* vm, const struct program* prog, size_t ngroups) {
+    memset(vm, 0, sizeof(*vm));
+    vm->ncaps = 2 * (ngroups + 1);
+    for (int i = 0; i < 2; i++) {
+        vm->lists[i].pcs = malloc(prog->len * sizeof(int));
+        vm->lists[i].caps = malloc(prog->len * vm->ncaps * sizeof(long));
+        if (!vm->lists[i].pcs || !vm->lists[i].caps) {
+            return -1;
+        }
+    }
+    vm->scratch = malloc(vm->ncaps * sizeof(long));
+    vm->stack = malloc((2 * prog->len + 1) * sizeof(*vm->stack));
+    vm->seen = calloc(prog->len, sizeof(*vm->seen));
+    return vm->scratch && vm->stack && vm->seen ? 0 : -1;
+}
+
+static void pike_destroy(struct pike* vm) {
+    for (int i = 0; i < 2; i++) {
+        free(vm->lists[i].pcs);
+        free(vm->lists[i].caps);
+    }
+    free(vm->scratch);
+    free(vm->stack);
+    free(vm->seen);
+}
+
+// Adds the threads reachable from pc to the list in priority order, each with
+// its own copy of the groups. vm->scratch holds the groups and is restored.
+static void pike_add(struct pike* vm, const struct program* prog, struct threads* list, int pc, long pos,
+                     int bol, int eol) {
+    int sp = 0;
+    long* caps = vm->scratch;
+    vm->stack[sp++] = (struct frame){pc, -1, 0};
+    while (sp > 0) {
+        struct frame f = vm->stack[--sp];
+        if (f.slot >= 0) {
+            caps[f.slot] = f.value;
+            continue;
+        }
+        for (pc = f.pc; vm->seen[pc] != vm->gen;) {
+            const struct inst* in = &prog->code[pc];
+            vm->seen[pc] = vm->gen;
+            if (in->op == I_JMP) {
+                pc = in->x;
+            } else if (in->op == I_SPLIT) {
+                vm->stack[sp++] = (struct frame){in->y, -1, 0};
+                pc = in->x;
+            } else if (in->op == I_SAVE) {
+                if (in->x < vm->active) {
+                    vm->stack[sp++] = (struct frame){0, in->x, caps[in->x]};
+                    caps[in->x] = pos;
+                }
+                pc++;
+            } else if ((in->op == I_BOL && bol) || (in->op == I_EOL && eol)) {
+                pc++;
+            } else if (in->op == I_SET || in->op == I_MATCH) {
+                list->pcs[list->n] = pc;
+                memcpy(list->caps + list->n * vm->ncaps, caps, vm->active * sizeof(long));
+                list->n++;
+            }
+        }
+    }
+}
+
+// Groups of the highest priority parse of [s, e), which is known to match
+static void pike_run(struct dfa_regex* re, const unsigned char* text, size_t start, size_t end, int notbol,
+                     size_t s, size_t e, regmatch_t* matches, size_t nmatch) {
+    struct pike* vm = &re->vm;
+    struct threads* cur = &vm->lists[0];
+    struct threads* next = &vm->lists[1];
+    vm->active = nmatch < re->ngroups + 1 ? (int)(2 * nmatch) : vm->ncaps;
+    for (int i = 0; i < vm->active; i++) {
+        vm->scratch[i] = -1;
+    }
+    next_gen(&vm->gen, vm->seen, re->forward.len);
+    cur->n = 0;
+    pike_add(vm, &re->forward, cur, 0, s, s == start && !notbol, s == end);
+    for (size_t pos = s; pos < e && cur->n > 0; pos++) {
+        next_gen(&vm->gen, vm->seen, re->forward.len);
+        next->n = 0;
+        for (int i = 0; i < cur->n; i++) {
+            const struct inst* in = &re->forward.code[cur->pcs[i]];
+            if (in->op == I_SET && set_has(&re->sets[in->x], text[pos])) {
+                memcpy(vm->scratch, cur->caps + i * vm->ncaps, vm->active * sizeof(long));
+                pike_add(vm, &re->forward, next, cur->pcs[i] + 1, pos + 1, 0, pos + 1 == end);
+            }
+        }
+        struct threads* swap = cur;
+        cur = next;
+        next = swap;
+    }
+    const long* caps = NULL;
+    for (int i = 0; i < cur->n && !caps; i++) {
+        if (re->forward.code[cur->pcs[i]].op == I_MATCH) {
+            caps = cur->caps + i * vm->ncaps;
+        }
+    }
+    for (size_t g = 1; g < nmatch; g++) {
+        int set = caps && 2 * (long)g + 1 < vm->active && caps[2 * g] >= 0 && caps[2 * g + 1] >= 0;
+        matches[g].rm_so = set ? caps[2 * g] : -1;
+        matches[g].rm_eo = set ? caps[2 * g + 1] : -1;
+    }
+}
+
+struct dfa_regex* dfa_compile(const char* regexp) {
+    struct dfa_regex* re = calloc(1, sizeof(*re));
+    if (!re) {
+        fprintf(stderr, "Error in malloc\n");
+        return NULL;
+    }
+    struct parser ps = {regexp, regexp + strlen(regexp), re, NULL};
+    int root = parse_alt(&ps);
+    if (root >= 0 && ps.p < ps.end) {
+        fail(&ps, "Unmatched ) or \\)");
+    }
+    struct program* progs[] = {&re->forward, &re->reverse};
+    for (int i = 0; i < 2 && !ps.error; i++) {
+        if (!(progs[i]->code = malloc(MAX_PROGRAM * sizeof(struct inst)))) {
+            fail(&ps, "Memory exhausted");
+        } else if (emit_node(re, progs[i], root, i) < 0 || emit(progs[i], I_MATCH, 0, 0) < 0) {
+            fail(&ps, "Regular expression too big");
+        }
+    }
+    if (!ps.error && (dfa_init(&re->fwd, &re->forward, re->sets, 0) != 0 ||
+                      dfa_init(&re->rev, &re->reverse, re->sets, 1) != 0 ||
+                      pike_init(&re->vm, &re->forward, re->ngroups) != 0)) {
+        fail(&ps, "Memory exhausted");
+    }
+    free(re->nodes);
+    re->nodes = NULL;
+    if (ps.error) {
+        fprintf(stderr, "Regex error: %s\n", ps.error);
+        dfa_free(re);
+        return NULL;
+    }
+    return re;
+}
+
+size_t dfa_groups(const struct dfa_regex* re) {
+    return re->ngroups;
+}
+
+// Leftmost-longest match in [start, end) of text, reported like regexec with
+// REG_STARTEND. The forward DFA finds where the match ends, the reverse DFA run
+// back from there finds where it starts, and only then, if groups are wanted,
+// the Pike VM goes over the match itself.
+int dfa_search(struct dfa_regex* re, const char* string, size_t start, size_t end, int notbol,
+               regmatch_t* matches, size_t nmatch) {
+    const unsigned char* text = (const unsigned char*)string;
+    struct dfa* d = &re->fwd;
+    long found = -1;
+    size_t i = start;
+    int s = dfa_start(d, !notbol);
+    if (s >= 0 && (d->states[s].flags & S_MATCH)) {
+        found = start;
+    }
+    for (; s >= 0 && i < end && !(d->states[s].flags & S_DEAD); i++) {
+        int next = d->states[s].next[text[i]];
+        s = next >= 0 ? next : dfa_next(d, s, text[i]);
+        if (s >= 0 && (d->states[s].flags & S_MATCH)) {
+            found = i + 1;
+        }
+    }
+    if (s >= 0 && i == end && !(d->states[s].flags & S_DEAD) && (s = dfa_next(d, s, 256)) >= 0 &&
+        (d->states[s].flags & S_MATCH)) {
+        found = end;
+    }
+    if (s < 0) {
+        fprintf(stderr, "Regex error: Memory exhausted\n");
+        return REG_ESPACE;
+    } else if (found < 0) {
+        return REG_NOMATCH;
+    }
+
+    size_t e = found;
+    long first = e;
+    d = &re->rev;
+    s = dfa_start(d, e == end);
+    for (i = e; s >= 0 && i > start && !(d->states[s].flags & S_DEAD); i--) {
+        int next = d->states[s].next[text[i - 1]];
+        s = next >= 0 ? next : dfa_next(d, s, text[i - 1]);
+        if (s >= 0 && (d->states[s].flags & S_MATCH)) {
+            first = i - 1;
+        }
+    }
+    if (s >= 0 && i == start && !notbol && !(d->states[s].flags & S_DEAD) && (s = dfa_next(d, s, 256)) >= 0 &&
+        (d->states[s].flags & S_MATCH)) {
+        first = start;
+    }
+    if (s < 0) {
+        fprintf(stderr, "Regex error: Memory exhausted\n");
+        return REG_ESPACE;
+    }
+    matches[0].rm_so = first;
+    matches[0].rm_eo = e;
+    if (nmatch > 1) {
+        pike_run(re, text, start, end, notbol, first, e, matches, nmatch);
+    }
+    return 0;
+}
+
+void dfa_free(struct dfa_regex* re) {
+    if (!re) {
+        return;
+    }
+    dfa_destroy(&re->fwd);
+    dfa_destroy(&re->rev);
+    pike_destroy(&re->vm);
+    free(re->forward.code);
+    free(re->reverse.code);
+    free(re->sets);
+    free(re->nodes);
+    free(re);
+}
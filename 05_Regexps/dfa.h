@@ -0,0 +1,26 @@
+#ifndef DFA_H
+#define DFA_H
+
+#include <stddef.h>
+#include <regex.h>
+
+// Built-in POSIX ERE engine: a Thompson NFA run as a lazily built DFA to find
+// the leftmost-longest match, and as a Pike VM only when groups are needed.
+// There is no backtracking, but only one search is linear in the text it
+// reads: to rule out a longer match it may read to the end of the range, so
+// repeated searches (esub -g) can be quadratic in the line length, as
+// `(x*)(x*)y|x` over a long run of x is.
+// Of the GNU escapes \w, \W, \s and \S are supported; back-references (\1 to
+// \9) and the anchors \b, \B, \<, \>, \` and \' are not, and are rejected
+// with an error naming the posix engine. Unlike glibc, groups are filled
+// leftmost-first, as in Perl, while the overall match is still the POSIX
+// leftmost-longest one.
+struct dfa_regex;
+
+struct dfa_regex* dfa_compile(const char* regexp);
+size_t dfa_groups(const struct dfa_regex* re);
+int dfa_search(struct dfa_regex* re, const char* text, size_t start, size_t end, int notbol,
+               regmatch_t* matches, size_t nmatch);
+void dfa_free(struct dfa_regex* re);
+
+#endif
@@ -1,166 +1,1164 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <regex.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dfa.h"
 
-#define MAX_GROUPS 10
+#define BLOCK_SIZE (1 << 20)
+#define OUTPUT_SIZE (1 << 16)
+#define MAX_NEEDLES 8
+#define MAX_NEEDLE 256
+#define CHUNK_SIZE (4 << 20)
+#define CHUNKS_PER_WORKER 4
+#define PASSTHROUGH_MIN (16 << 10)
 
-const char* COLORS[] = {
-    "\033[31m", "\033[32m", "\033[33m", "\033[34m", "\033[35m",
-    "\033[36m", "\033[91m", "\033[92m", "\033[93m", "\033[0m" 
+// Escape sequences with their lengths, so coloring a group costs one memcpy
+struct color {
+    const char* code;
+    size_t len;
 };
 
-char* process_match(const char* substitution, const regmatch_t* matches, const char* original, const int use_color) {
-    size_t sub_len = strlen(substitution);
-    char* result = malloc(sub_len * 5 + 1); // for colors
-    if (!result) {
+#define COLOR(code) {code, sizeof(code) - 1}
+
+const struct color COLORS[] = {
+    COLOR("\033[31m"), COLOR("\033[32m"), COLOR("\033[33m"), COLOR("\033[34m"), COLOR("\033[35m"),
+    COLOR("\033[36m"), COLOR("\033[91m"), COLOR("\033[92m"), COLOR("\033[93m")
+};
+const struct color RESET = COLOR("\033[0m");
+#define NCOLORS (sizeof(COLORS) / sizeof(COLORS[0]))
+
+void print_regexp_error(int errcode, const regex_t *preg) {
+    char error_msg[1024];
+    regerror(errcode, preg, error_msg, sizeof(error_msg));
+    fprintf(stderr, "Regex error: %s\n", error_msg);
+}
+
+enum engine_type { ENGINE_POSIX, ENGINE_DFA };
+enum color_mode { COLOR_NEVER, COLOR_AUTO, COLOR_ALWAYS };
+
+struct options {
+    enum engine_type engine;
+    enum color_mode color;
+    int use_color;
+    int global;
+    int files;
+    int stats;
+    int jobs;
+    int in_place;
+    char* regexp;
+    char* substitution;
+    char** inputs;
+    int ninputs;
+};
+
+// All output goes through one buffer, written out with write(2) when full.
+// Without a file descriptor the buffer grows and keeps everything. Unchanged
+// input is only noted until something else is written; when the input is a
+// mapped file, long spans of it are copied file to file by the kernel.
+struct output {
+    int fd;
+    char* data;
+    size_t size;
+    size_t len;
+    char last;
+    int error;
+    const char* kept;
+    size_t kept_len;
+    int source;         // descriptor the input is mapped from, if base is set
+    const char* base;
+};
+
+void output_raw(struct output* out, const char* data, size_t len) {
+    size_t done = 0;
+    while (done < len && !out->error) {
+        ssize_t written = write(out->fd, data + done, len - done);
+        if (written < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: write failed: %s\n", strerror(errno));
+            out->error = 1;
+        } else if (written > 0) {
+            done += written;
+        }
+    }
+}
+
+void output_settle(struct output* out);
+
+void output_flush(struct output* out) {
+    output_settle(out);
+    output_raw(out, out->data, out->len);
+    out->len = 0;
+}
+
+void output_write(struct output* out, const char* data, size_t len) {
+    if (out->kept_len > 0) {
+        output_settle(out);
+    }
+    if (len > 0) {
+        out->last = data[len - 1];
+    }
+    if (out->len + len > out->size && out->fd < 0) {
+        size_t size = out->size ? out->size : OUTPUT_SIZE;
+        while (size < out->len + len) {
+            size *= 2;
+        }
+        char* bigger = realloc(out->data, size);
+        if (!bigger) {
+            fprintf(stderr, "Error in malloc\n");
+            out->error = 1;
+            return;
+        }
+        out->data = bigger;
+        out->size = size;
+    } else if (out->len + len > out->size) {
+        output_flush(out);
+        if (len > out->size) {
+            output_raw(out, data, len);
+            return;
+        }
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+void output_keep(struct output* out, const char* data, size_t len) {
+    if (!out->kept || out->kept + out->kept_len != data) {
+        output_settle(out);
+        out->kept = data;
+    }
+    out->kept_len += len;
+}
+
+// Writes out the kept span of input
+void output_settle(struct output* out) {
+    const char* data = out->kept;
+    size_t len = out->kept_len;
+    out->kept = NULL;
+    out->kept_len = 0;
+    if (len == 0) {
+        return;
+    } else if (!out->base || out->fd < 0 || len < PASSTHROUGH_MIN) {
+        output_write(out, data, len);
+        return;
+    }
+    output_flush(out);
+    out->last = data[len - 1];
+    off_t offset = data - out->base;
+    while (len > 0 && !out->error) {
+        ssize_t copied = copy_file_range(out->source, &offset, out->fd, NULL, len, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        } else if (copied <= 0) {
+            // Not supported between these files: write it from the mapping
+            output_raw(out, out->base + offset, len);
+            break;
+        }
+        len -= copied;
+    }
+}
+
+// The substitution, parsed once: literal runs and group references
+enum op_type { OP_LITERAL, OP_GROUP };
+
+struct op {
+    enum op_type type;
+    size_t arg;     // offset into text, or group number
+    size_t len;     // length of the literal
+};
+
+struct template {
+    struct op* ops;
+    size_t nops;
+    char* text;
+    size_t nmatch;  // groups the engine has to report, the whole match included
+};
+
+void free_template(struct template* tmpl) {
+    free(tmpl->ops);
+    free(tmpl->text);
+}
+
+int add_op(struct template* tmpl, enum op_type type, size_t arg, size_t len) {
+    struct op* last = tmpl->nops ? &tmpl->ops[tmpl->nops - 1] : NULL;
+    if (type == OP_LITERAL && last && last->type == OP_LITERAL && last->arg + last->len == arg) {
+        last->len += len;
+        return 0;
+    }
+    struct op* ops = realloc(tmpl->ops, (tmpl->nops + 1) * sizeof(*ops));
+    if (!ops) {
         fprintf(stderr, "Error in malloc\n");
-        return NULL;
-    }
-    size_t result_len = 0, i = 0;
-    while (i < sub_len) {
-        if (substitution[i] == '\\') {
-            if (i + 1 < sub_len) {
-                if (substitution[i + 1] == '\\') {
-                    result[result_len++] = '\\';
-                    i += 2;
-                } else if (substitution[i + 1] >= '0' && substitution[i + 1] <= '9') {
-                    int group_num = substitution[i + 1] - '0';
-                    
-                    if (group_num < MAX_GROUPS && matches[group_num].rm_so != -1) {
-                        int start = matches[group_num].rm_so;
-                        int end = matches[group_num].rm_eo;
-                        int length = end - start;
-                        
-                        if (use_color && group_num > 0) {
-                            const char* color = COLORS[group_num - 1];
-                            size_t color_len = strlen(color);
-                            memcpy(result + result_len, color, color_len);
-                            result_len += color_len;
-                        }
-                        
-                        memcpy(result + result_len, original + start, length);
-                        result_len += length;
-                        
-                        if (use_color && group_num > 0) {
-                            const char* reset_color = COLORS[9];
-                            size_t reset_len = strlen(reset_color);
-                            memcpy(result + result_len, reset_color, reset_len);
-                            result_len += reset_len;
-                        }
-                    } else {
-                        fprintf(stderr, "Regex error: reference to non-existent group \\%d\n", group_num);
-                        free(result);
-                        return NULL;
-                    }
-                    i += 2;
-                } else {
-                    result[result_len++] = substitution[i++];
-                    result[result_len++] = substitution[i++];
-                }
-            } else {
-                result[result_len++] = substitution[i++];
+        return 1;
+    }
+    tmpl->ops = ops;
+    tmpl->ops[tmpl->nops++] = (struct op){type, arg, len};
+    return 0;
+}
+
+// Named groups: (?<name>re) is rewritten into a plain group for the engines
+struct group_names {
+    char* regexp;
+    char** names;       // by group number, NULL for unnamed groups
+    size_t ngroups;
+};
+
+void free_group_names(struct group_names* names) {
+    for (size_t i = 0; names->names && i <= names->ngroups; i++) {
+        free(names->names[i]);
+    }
+    free(names->names);
+    free(names->regexp);
+}
+
+const char* skip_bracket(const char* p, const char* end);
+
+int is_name(const char* name, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!(isalpha((unsigned char)name[i]) || name[i] == '_' || (i > 0 && isdigit((unsigned char)name[i])))) {
+            return 0;
+        }
+    }
+    return len > 0;
+}
+
+size_t find_name(const struct group_names* names, const char* name, size_t len) {
+    for (size_t i = 1; i <= names->ngroups; i++) {
+        if (names->names[i] && strlen(names->names[i]) == len && strncmp(names->names[i], name, len) == 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+int extract_group_names(const char* regexp, struct group_names* names) {
+    size_t len = strlen(regexp), groups = 0;
+    const char* end = regexp + len;
+    memset(names, 0, sizeof(*names));
+    for (const char* p = regexp; p < end; p++) {
+        groups += *p == '(';
+        p += *p == '\\';
+    }
+    names->regexp = malloc(len + 1);
+    names->names = calloc(groups + 1, sizeof(*names->names));
+    if (!names->regexp || !names->names) {
+        fprintf(stderr, "Error in malloc\n");
+        free_group_names(names);
+        return 1;
+    }
+    char* out = names->regexp;
+    for (const char* p = regexp; p < end;) {
+        const char* next = p + 1;
+        if (*p == '\\') {
+            next = p + 2 <= end ? p + 2 : end;
+        } else if (*p == '[') {
+            const char* close = skip_bracket(p, end);
+            next = close ? close + 1 : end;
+        } else if (*p == '(' && end - p > 3 && p[1] == '?' && p[2] == '<') {
+            const char* name = p + 3;
+            const char* close = memchr(name, '>', end - name);
+            if (!close || !is_name(name, close - name) || find_name(names, name, close - name)) {
+                fprintf(stderr, "Regex error: invalid or repeated group name in %.*s\n", (int)(end - p), p);
+                free_group_names(names);
+                return 1;
+            }
+            names->names[++names->ngroups] = strndup(name, close - name);
+            if (!names->names[names->ngroups]) {
+                fprintf(stderr, "Error in malloc\n");
+                free_group_names(names);
+                return 1;
             }
+            *out++ = '(';
+            p = close + 1;
+            continue;
+        } else if (*p == '(') {
+            names->ngroups++;
+        }
+        memcpy(out, p, next - p);
+        out += next - p;
+        p = next;
+    }
+    *out = '\0';
+    return 0;
+}
+
+// Reference after a backslash: \N (one digit, so \10 is group 1 and a '0' as
+// in sed), \{N} or \{name}. Returns its length, or 0 if it is not a reference.
+size_t group_reference(const char* ref, const struct group_names* names, size_t* group) {
+    if (isdigit((unsigned char)ref[0])) {
+        *group = ref[0] - '0';
+        return 1;
+    }
+    const char* close = ref[0] == '{' ? strchr(ref, '}') : NULL;
+    size_t len = close ? close - ref - 1 : 0;
+    if (len > 0 && strspn(ref + 1, "0123456789") == len) {
+        *group = strtoul(ref + 1, NULL, 10);
+        return len + 2;
+    } else if (is_name(ref + 1, len)) {
+        if (!(*group = find_name(names, ref + 1, len))) {
+            fprintf(stderr, "Regex error: reference to unknown group name %.*s\n", (int)len, ref + 1);
+            *group = (size_t)-1;
+        }
+        return len + 2;
+    }
+    return 0;
+}
+
+// \N, \{N} and \{name} are groups, \\ a backslash, any other backslash is kept as is
+int compile_template(const char* substitution, const struct group_names* names, size_t ngroups,
+                     struct template* tmpl) {
+    size_t sub_len = strlen(substitution), text_len = 0, i = 0;
+    memset(tmpl, 0, sizeof(*tmpl));
+    tmpl->nmatch = 1;
+    if (!(tmpl->text = malloc(sub_len + 1))) {
+        fprintf(stderr, "Error in malloc\n");
+        return 1;
+    }
+    int error = 0;
+    while (i < sub_len && !error) {
+        size_t group_num, ref_len = substitution[i] == '\\' ? group_reference(substitution + i + 1, names, &group_num) : 0;
+        if (ref_len > 0) {
+            if (group_num == (size_t)-1) {
+                error = 1;
+                break;
+            } else if (group_num > ngroups) {
+                fprintf(stderr, "Regex error: reference to non-existent group \\%zu\n", group_num);
+                error = 1;
+                break;
+            }
+            error = add_op(tmpl, OP_GROUP, group_num, 0);
+            if (group_num >= tmpl->nmatch) {
+                tmpl->nmatch = group_num + 1;
+            }
+            i += ref_len + 1;
+            continue;
+        }
+        size_t start = text_len;
+        if (substitution[i] == '\\' && i + 1 < sub_len && substitution[i + 1] == '\\') {
+            tmpl->text[text_len++] = '\\';
+            i += 2;
+        } else if (substitution[i] == '\\' && i + 1 < sub_len) {
+            tmpl->text[text_len++] = substitution[i++];
+            tmpl->text[text_len++] = substitution[i++];
         } else {
-            result[result_len++] = substitution[i++];
+            tmpl->text[text_len++] = substitution[i++];
         }
+        error = add_op(tmpl, OP_LITERAL, start, text_len - start);
+    }
+    if (error) {
+        free_template(tmpl);
+    }
+    return error;
+}
+
+// Group N is colored COLORS[(N - 1) % NCOLORS]. A color is switched only when it
+// changes, so neighbouring groups of one color share one escape and one reset.
+void apply_template(const struct template* tmpl, const regmatch_t* matches, const char* line, int use_color,
+                    struct output* out) {
+    const struct color* current = NULL;
+    for (size_t i = 0; i < tmpl->nops; i++) {
+        const struct op* op = &tmpl->ops[i];
+        const char* text = tmpl->text + op->arg;
+        size_t len = op->len;
+        const struct color* color = NULL;
+        if (op->type == OP_GROUP) {
+            const regmatch_t* group = &matches[op->arg];
+            if (group->rm_so == group->rm_eo) {
+                // Empty, or did not take part in the match (rm_so == -1)
+                continue;
+            }
+            text = line + group->rm_so;
+            len = group->rm_eo - group->rm_so;
+            color = use_color && op->arg > 0 ? &COLORS[(op->arg - 1) % NCOLORS] : NULL;
+        }
+        if (color != current) {
+            const struct color* code = color ? color : &RESET;
+            output_write(out, code->code, code->len);
+            current = color;
+        }
+        output_write(out, text, len);
+    }
+    if (current) {
+        output_write(out, RESET.code, RESET.len);
+    }
+}
+
+// A compiled regexp behind a search with regexec's REG_STARTEND conventions:
+// look in [start, end) of text, ^ matches at start unless notbol. Returns 0,
+// REG_NOMATCH or an error code (the engine has already reported it).
+struct engine {
+    size_t ngroups;
+    void* impl;
+    int (*search)(void* impl, const char* text, size_t start, size_t end, int notbol, regmatch_t* matches,
+                  size_t nmatch);
+    void (*release)(void* impl);
+};
+
+int posix_search(void* impl, const char* text, size_t start, size_t end, int notbol, regmatch_t* matches,
+                 size_t nmatch) {
+    matches[0].rm_so = start;
+    matches[0].rm_eo = end;
+    int result = regexec(impl, text, nmatch, matches, REG_STARTEND | (notbol ? REG_NOTBOL : 0));
+    if (result != 0 && result != REG_NOMATCH) {
+        print_regexp_error(result, impl);
     }
-    result[result_len] = '\0';
     return result;
 }
 
-void print_regexp_error(int errcode, const regex_t *preg) {
-    char error_msg[1024];
-    regerror(errcode, preg, error_msg, sizeof(error_msg));
-    fprintf(stderr, "Regex error: %s\n", error_msg);
+void posix_release(void* impl) {
+    regfree(impl);
+    free(impl);
+}
+
+int dfa_engine_search(void* impl, const char* text, size_t start, size_t end, int notbol, regmatch_t* matches,
+                      size_t nmatch) {
+    return dfa_search(impl, text, start, end, notbol, matches, nmatch);
+}
+
+void dfa_engine_release(void* impl) {
+    dfa_free(impl);
 }
 
-int replace(const char* input, const char* regexp_str, const char* substitution, const int use_color) {
-    regex_t regex;
-    regmatch_t matches[MAX_GROUPS];    
-    int regex_result = regcomp(&regex, regexp_str, REG_EXTENDED);
+int open_engine(enum engine_type type, const char* regexp, struct engine* engine) {
+    if (type == ENGINE_DFA) {
+        struct dfa_regex* re = dfa_compile(regexp);
+        if (!re) {
+            return 1;
+        }
+        *engine = (struct engine){dfa_groups(re), re, dfa_engine_search, dfa_engine_release};
+        return 0;
+    }
+    regex_t* regex = malloc(sizeof(*regex));
+    if (!regex) {
+        fprintf(stderr, "Error in malloc\n");
+        return 1;
+    }
+    int regex_result = regcomp(regex, regexp, REG_EXTENDED);
     if (regex_result != 0) {
-        print_regexp_error(regex_result, &regex);
+        print_regexp_error(regex_result, regex);
+        free(regex);
+        return 1;
+    }
+    *engine = (struct engine){regex->re_nsub, regex, posix_search, posix_release};
+    return 0;
+}
+
+// Substitute in one line of `len` bytes (no newline, no terminating NUL needed).
+// Further matches are searched from the end of the previous one; as in sed, an
+// empty match right after a previous match is not replaced.
+int substitute_line(const struct engine* engine, const struct template* tmpl, const char* line, size_t len,
+                    const struct options* opts, struct output* out) {
+    regmatch_t matches[tmpl->nmatch];
+    size_t pos = 0, copied = 0, last_end = (size_t)-1;
+    while (pos <= len) {
+        int regex_result = engine->search(engine->impl, line, pos, len, pos > 0, matches, tmpl->nmatch);
+        if (regex_result == REG_NOMATCH) {
+            break;
+        } else if (regex_result != 0) {
+            return 1;
+        }
+        size_t start = matches[0].rm_so, end = matches[0].rm_eo;
+        if (start != end || start != last_end) {
+            output_keep(out, line + copied, start - copied);
+            apply_template(tmpl, matches, line, opts->use_color, out);
+            copied = end;
+            last_end = end;
+            if (!opts->global) {
+                break;
+            }
+        }
+        pos = end > start ? end : end + 1;
+    }
+    output_keep(out, line + copied, len - copied);
+    return 0;
+}
+
+// Prefilter: literal strings one of which every match has to contain (one per
+// top-level alternative). Lines without any of them never reach regexec.
+struct prefilter {
+    int count;
+    char needles[MAX_NEEDLES][MAX_NEEDLE];
+    size_t lens[MAX_NEEDLES];
+    unsigned long lines;
+    unsigned long skipped;
+};
+
+// End of the bracket expression starting at `p` ('['), or NULL
+const char* skip_bracket(const char* p, const char* end) {
+    p++;
+    p += p < end && *p == '^';
+    p += p < end && *p == ']';
+    for (; p < end; p++) {
+        if (*p == '[' && p + 1 < end && strchr(":.=", p[1])) {
+            const char* close = p + 2;
+            while (close + 1 < end && !(close[0] == p[1] && close[1] == ']')) {
+                close++;
+            }
+            if (close + 1 >= end) {
+                return NULL;
+            }
+            p = close + 1;
+        } else if (*p == ']') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Longest run of characters that is outside groups and not optional: a match of
+// the alternative [p, end) contains it. Returns its length (0 if there is none).
+size_t required_literal(const char* p, const char* end, char* out) {
+    char run[MAX_NEEDLE];
+    size_t best = 0, len = 0;
+    int depth = 0;
+    for (; p < end; p++) {
+        char c = *p;
+        int literal = 0;
+        if (c == '\\' && p + 1 < end) {
+            c = *++p;
+            literal = depth == 0 && strchr(".[]()*+?{}|^$\\/", c) != NULL;
+        } else if (c == '[') {
+            if (!(p = skip_bracket(p, end))) {
+                break;
+            }
+        } else if (c == '{') {
+            if (!(p = memchr(p, '}', end - p))) {
+                break;
+            }
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth -= depth > 0;
+        } else {
+            literal = depth == 0 && !strchr(".*+?^$\\", c);
+        }
+        // A quantifier that allows zero repetitions makes the character optional
+        int optional = p + 1 < end && strchr("*?{", p[1]);
+        if (literal && !optional && len < MAX_NEEDLE) {
+            run[len++] = c;
+            if (len > best) {
+                memcpy(out, run, len);
+                best = len;
+            }
+        } else {
+            len = 0;
+        }
+    }
+    return best;
+}
+
+void analyze_regexp(const char* regexp, struct prefilter* filter) {
+    const char* end = regexp + strlen(regexp);
+    const char* branch = regexp;
+    int depth = 0;
+    filter->count = 0;
+    for (const char* p = regexp; p <= end; p++) {
+        if (p < end && *p == '\\') {
+            p++;
+        } else if (p < end && *p == '[') {
+            if (!(p = skip_bracket(p, end))) {
+                break;
+            }
+        } else if (p < end && (*p == '(' || *p == ')')) {
+            depth += *p == '(' ? 1 : -1;
+        } else if (p == end || (*p == '|' && depth == 0)) {
+            size_t len;
+            if (filter->count == MAX_NEEDLES ||
+                !(len = required_literal(branch, p, filter->needles[filter->count]))) {
+                break;
+            }
+            filter->lens[filter->count++] = len;
+            branch = p + 1;
+            if (p == end) {
+                return;
+            }
+        }
+    }
+    // Some alternative has no required literal: no prefiltering
+    filter->count = 0;
+}
+
+// First place in [p, end) where some needle occurs, or NULL. `next` remembers
+// where each needle was found last, so every needle scans the block only once.
+const char* find_candidate(const struct prefilter* filter, const char** next, const char* p, const char* end) {
+    const char* first = NULL;
+    for (int i = 0; i < filter->count; i++) {
+        if (next[i] && next[i] != end && next[i] < p) {
+            next[i] = NULL;
+        }
+        if (!next[i]) {
+            next[i] = memmem(p, end - p, filter->needles[i], filter->lens[i]);
+            next[i] = next[i] ? next[i] : end;
+        }
+        if (next[i] != end && (!first || next[i] < first)) {
+            first = next[i];
+        }
+    }
+    return first;
+}
+
+unsigned long count_lines(const char* p, const char* end) {
+    unsigned long lines = 0;
+    while ((p = memchr(p, '\n', end - p))) {
+        p++;
+        lines++;
+    }
+    return lines;
+}
+
+// Substitute in the complete lines of [p, limit); the last one may lack its newline.
+// Runs of lines the prefilter rules out are copied to the output in one piece.
+int substitute_lines(const struct engine* engine, const struct template* tmpl, struct prefilter* filter,
+                     const char* p, const char* limit, const struct options* opts, struct output* out) {
+    const char* next[MAX_NEEDLES] = {NULL};
+    while (p < limit) {
+        if (filter->count) {
+            const char* hit = find_candidate(filter, next, p, limit);
+            const char* line = hit ? memrchr(p, '\n', hit - p) : NULL;
+            line = !hit ? limit : line ? line + 1 : p;
+            if (opts->stats) {
+                filter->skipped += count_lines(p, line) + (line == limit && line > p && line[-1] != '\n');
+            }
+            output_keep(out, p, line - p);
+            if (!hit) {
+                break;
+            }
+            p = line;
+        }
+        const char* newline = memchr(p, '\n', limit - p);
+        const char* end = newline ? newline : limit;
+        if (substitute_line(engine, tmpl, p, end - p, opts, out) != 0) {
+            return 1;
+        }
+        if (newline) {
+            output_keep(out, newline, 1);
+        }
+        filter->lines++;
+        p = newline ? end + 1 : end;
+    }
+    output_settle(out);
+    return out->error;
+}
+
+// Streaming mode: read big blocks, substitute line by line in place. A line
+// longer than the buffer makes it grow.
+int substitute_stream(const struct engine* engine, const struct template* tmpl, struct prefilter* filter, int fd,
+                      const char* name, const struct options* opts, struct output* out) {
+    static char* buffer = NULL;
+    static size_t size = 0;
+    size_t have = 0;
+    ssize_t got = 1;
+    if (!buffer && !(buffer = malloc(size = BLOCK_SIZE))) {
+        fprintf(stderr, "Error in malloc\n");
         return 1;
     }
+    while (got > 0) {
+        if (have == size) {
+            char* bigger = realloc(buffer, size * 2);
+            if (!bigger) {
+                fprintf(stderr, "Error in malloc\n");
+                return 1;
+            }
+            buffer = bigger;
+            size *= 2;
+        }
+        got = read(fd, buffer + have, size - have);
+        if (got < 0 && errno == EINTR) {
+            got = 1;
+            continue;
+        } else if (got < 0) {
+            fprintf(stderr, "Error: cannot read %s: %s\n", name, strerror(errno));
+            return 1;
+        }
+        have += got;
+        
+        // Complete lines only; at end of input the last line may have no newline
+        char* last = got == 0 ? NULL : memrchr(buffer, '\n', have);
+        const char* limit = got == 0 ? buffer + have : last ? last + 1 : buffer;
+        if (substitute_lines(engine, tmpl, filter, buffer, limit, opts, out) != 0) {
+            return 1;
+        }
+        have -= limit - buffer;
+        memmove(buffer, limit, have);
+    }
+    return out->error;
+}
+
+// Parallel mode: a mapped file is cut at newlines into chunks which workers,
+// each with its own compiled regexp, substitute into memory. Chunks are written
+// out in order; at most CHUNKS_PER_WORKER per worker are queued or waiting.
+struct chunk {
+    const char* data;
+    size_t len;
+    struct output out;
+    int result;
+    int done;
+};
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct chunk* chunks;
+    size_t window;
+    size_t queued;
+    size_t taken;
+    size_t written;
+    int eof;
+    const struct template* tmpl;
+    const struct options* opts;
+};
+
+struct worker {
+    struct pool* pool;
+    struct engine engine;
+    struct prefilter filter;
+    pthread_t thread;
+};
+
+void* chunk_worker(void* arg) {
+    struct worker* w = arg;
+    struct pool* pool = w->pool;
     
-    regex_result = regexec(&regex, input, MAX_GROUPS, matches, 0);
-    if (regex_result == REG_NOMATCH) {
-        printf("%s\n", input);
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->taken == pool->queued && !pool->eof) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->taken == pool->queued) {
+            break;
+        }
+        struct chunk* chunk = &pool->chunks[pool->taken++ % pool->window];
+        pthread_mutex_unlock(&pool->lock);
         
-        regfree(&regex);
-        return 0;
-    } else if (regex_result != 0) {
-        print_regexp_error(regex_result, &regex);
+        chunk->out.len = 0;
+        chunk->result = substitute_lines(&w->engine, pool->tmpl, &w->filter, chunk->data, chunk->data + chunk->len,
+                                         pool->opts, &chunk->out);
         
-        regfree(&regex);
+        pthread_mutex_lock(&pool->lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int start_pool(struct pool* pool, struct worker* workers, const char* regexp, const struct template* tmpl,
+               const struct prefilter* filter, const struct options* opts) {
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->window = (size_t)opts->jobs * CHUNKS_PER_WORKER;
+    pool->tmpl = tmpl;
+    pool->opts = opts;
+    if (!(pool->chunks = calloc(pool->window, sizeof(*pool->chunks)))) {
+        fprintf(stderr, "Error in malloc\n");
+        return -1;
+    }
+    for (size_t i = 0; i < pool->window; i++) {
+        pool->chunks[i].out.fd = -1;
+    }
+    int started = 0;
+    for (; started < opts->jobs; started++) {
+        struct worker* w = &workers[started];
+        w->pool = pool;
+        w->filter = *filter;
+        if (open_engine(opts->engine, regexp, &w->engine) != 0) {
+            break;
+        }
+        if (pthread_create(&w->thread, NULL, chunk_worker, w) != 0) {
+            fprintf(stderr, "Error: cannot start a worker thread\n");
+            w->engine.release(w->engine.impl);
+            break;
+        }
+    }
+    return started;
+}
+
+// Waits for the workers and adds their prefilter counts to `filter`
+void stop_pool(struct pool* pool, struct worker* workers, int started, struct prefilter* filter) {
+    pthread_mutex_lock(&pool->lock);
+    pool->eof = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        workers[i].engine.release(workers[i].engine.impl);
+        filter->lines += workers[i].filter.lines;
+        filter->skipped += workers[i].filter.skipped;
+    }
+    for (size_t i = 0; pool->chunks && i < pool->window; i++) {
+        free(pool->chunks[i].out.data);
+    }
+    free(pool->chunks);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+}
+
+int substitute_parallel(struct pool* pool, const char* data, size_t size, struct output* out) {
+    size_t offset = 0;
+    int result = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->written < pool->queued || offset < size) {
+        if (offset < size && pool->queued - pool->written < pool->window) {
+            struct chunk* chunk = &pool->chunks[pool->queued++ % pool->window];
+            size_t end = offset + CHUNK_SIZE < size ? offset + CHUNK_SIZE : size;
+            const char* newline = memchr(data + end, '\n', size - end);
+            end = newline ? (size_t)(newline - data) + 1 : size;
+            chunk->data = data + offset;
+            chunk->len = end - offset;
+            chunk->done = 0;
+            offset = end;
+            pthread_cond_broadcast(&pool->cond);
+            continue;
+        }
+        struct chunk* chunk = &pool->chunks[pool->written % pool->window];
+        while (!chunk->done) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        output_write(out, chunk->out.data, chunk->out.len);
+        result |= chunk->result;
+        pthread_mutex_lock(&pool->lock);
+        pool->written++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return result || out->error;
+}
+
+// A regular file bigger than a chunk is mapped and done in parallel
+int substitute_fd(const struct engine* engine, const struct template* tmpl, struct prefilter* filter,
+                  struct pool* pool, int fd, const char* name, const struct options* opts, struct output* out) {
+    struct stat st;
+    if (!pool || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= CHUNK_SIZE) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        return substitute_stream(engine, tmpl, filter, fd, name, opts, out);
+    }
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return substitute_stream(engine, tmpl, filter, fd, name, opts, out);
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    int result = substitute_parallel(pool, data, st.st_size, out);
+    munmap(data, st.st_size);
+    return result;
+}
+
+// Start of the first line in [p, end) with a match, or NULL
+const char* first_match(const struct engine* engine, struct prefilter* filter, const char* p, const char* end,
+                        const struct options* opts, int* error) {
+    const char* next[MAX_NEEDLES] = {NULL};
+    regmatch_t match;
+    while (p < end) {
+        if (filter->count) {
+            const char* hit = find_candidate(filter, next, p, end);
+            const char* line = hit ? memrchr(p, '\n', hit - p) : NULL;
+            line = !hit ? end : line ? line + 1 : p;
+            if (opts->stats) {
+                filter->skipped += count_lines(p, line) + (line == end && line > p && line[-1] != '\n');
+            }
+            if (!hit) {
+                return NULL;
+            }
+            p = line;
+        }
+        const char* newline = memchr(p, '\n', end - p);
+        int regex_result = engine->search(engine->impl, p, 0, (newline ? newline : end) - p, 0, &match, 1);
+        if (regex_result == 0) {
+            return p;
+        } else if (regex_result != REG_NOMATCH) {
+            *error = 1;
+            return NULL;
+        }
+        filter->lines++;
+        p = newline ? newline + 1 : end;
+    }
+    return NULL;
+}
+
+// In-place editing: the result goes to a temporary file next to the original,
+// which then replaces it by rename(2). Files without a match are not touched;
+// the text before the first match is copied by the kernel.
+int edit_in_place(const struct engine* engine, const struct template* tmpl, struct prefilter* filter,
+                  struct pool* pool, const char* name, const struct options* opts, int* edited) {
+    struct stat st;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: cannot edit %s: %s\n", name, fd < 0 ? strerror(errno) : "not a regular file");
+        if (fd >= 0) {
+            close(fd);
+        }
         return 1;
     }
-    char* result_sub = process_match(substitution, matches, input, use_color);
-    if (!result_sub) {
-        
-        regfree(&regex);
+    char* data = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map %s: %s\n", name, strerror(errno));
+        close(fd);
         return 1;
     }
-    int last_end = 0;
+    int error = 0;
+    const char* first = data ? first_match(engine, filter, data, data + st.st_size, opts, &error) : NULL;
+    if (!first) {
+        if (data) {
+            munmap(data, st.st_size);
+        }
+        close(fd);
+        return error;
+    }
     
-    if (matches[0].rm_so > 0) {
-        fprintf(stdout, "%.*s", (int)matches[0].rm_so, input);
+    const char* slash = strrchr(name, '/');
+    int dir_len = slash ? slash - name + 1 : 0;
+    char* temp = malloc(dir_len + sizeof(".esub.XXXXXX"));
+    int out_fd = -1;
+    if (temp) {
+        sprintf(temp, "%.*s.esub.XXXXXX", dir_len, name);
+        out_fd = mkstemp(temp);
+    }
+    if (out_fd < 0) {
+        fprintf(stderr, "Error: cannot create a temporary file for %s: %s\n", name, temp ? strerror(errno) : "no memory");
+        free(temp);
+        munmap(data, st.st_size);
+        close(fd);
+        return 1;
+    }
+    static char out_data[OUTPUT_SIZE];
+    struct output out = {.fd = out_fd, .data = out_data, .size = OUTPUT_SIZE, .source = fd, .base = data};
+    output_keep(&out, data, first - data);
+    if (pool && st.st_size - (first - data) > CHUNK_SIZE) {
+        output_settle(&out);
+        error = substitute_parallel(pool, first, st.st_size - (first - data), &out);
+    } else {
+        error = substitute_lines(engine, tmpl, filter, first, data + st.st_size, opts, &out);
+    }
+    output_flush(&out);
+    // The owner stays if we may set it; otherwise the file becomes ours, as with sed -i
+    fchmod(out_fd, st.st_mode & 07777);
+    fchown(out_fd, st.st_uid, st.st_gid);
+    if (close(out_fd) != 0 || out.error) {
+        error = 1;
+    }
+    if (!error && rename(temp, name) != 0) {
+        fprintf(stderr, "Error: cannot replace %s: %s\n", name, strerror(errno));
+        error = 1;
+    }
+    if (error) {
+        unlink(temp);
+    } else {
+        (*edited)++;
+    }
+    free(temp);
+    munmap(data, st.st_size);
+    close(fd);
+    return error;
+}
+
+int replace(const struct options* opts) {
+    struct group_names names;
+    struct engine engine;
+    struct template tmpl;
+    struct prefilter filter = {0};
+    struct pool pool;
+    struct worker* workers = NULL;
+    int started = 0;
+    static char out_data[OUTPUT_SIZE];
+    static struct output out = {.fd = STDOUT_FILENO, .data = out_data, .size = OUTPUT_SIZE};
+    if (extract_group_names(opts->regexp, &names) != 0) {
+        return 1;
+    }
+    if (open_engine(opts->engine, names.regexp, &engine) != 0) {
+        free_group_names(&names);
+        return 1;
+    }
+    int result = compile_template(opts->substitution, &names, engine.ngroups, &tmpl);
+    if (result == 0) {
+        analyze_regexp(names.regexp, &filter);
+    }
+    if (result == 0 && opts->files && opts->jobs > 1) {
+        if (!(workers = calloc(opts->jobs, sizeof(*workers)))) {
+            fprintf(stderr, "Error in malloc\n");
+            result = 1;
+        } else if ((started = start_pool(&pool, workers, names.regexp, &tmpl, &filter, opts)) < opts->jobs) {
+            result = 1;
+        }
+    }
+    free_group_names(&names);
+    if (result != 0) {
+        if (workers) {
+            stop_pool(&pool, workers, started, &filter);
+            free(workers);
+            free_template(&tmpl);
+        }
+        engine.release(engine.impl);
+        return 1;
     }
-    printf("%s", result_sub);
     
-    free(result_sub);
-    last_end = matches[0].rm_eo;
-    if (input[last_end] != '\0') {
-        printf("%s", input + last_end);
+    if (!opts->files) {
+        // The string argument, or standard input when there is none
+        if (opts->ninputs > 0) {
+            result = substitute_line(&engine, &tmpl, opts->inputs[0], strlen(opts->inputs[0]), opts, &out);
+            output_write(&out, "\n", 1);
+        } else {
+            result = substitute_stream(&engine, &tmpl, &filter, STDIN_FILENO, "stdin", opts, &out);
+        }
+    }
+    int edited = 0;
+    for (int i = 0; opts->in_place && i < opts->ninputs; i++) {
+        result |= edit_in_place(&engine, &tmpl, &filter, workers ? &pool : NULL, opts->inputs[i], opts, &edited);
+    }
+    for (int i = 0; opts->files && !opts->in_place && i < opts->ninputs && result == 0; i++) {
+        const char* name = opts->inputs[i];
+        int fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Error: cannot open %s: %s\n", name, strerror(errno));
+            result = 1;
+            break;
+        }
+        // Like sed, do not glue the next file to a last line without newline
+        if (out.last && out.last != '\n') {
+            output_write(&out, "\n", 1);
+        }
+        result = substitute_fd(&engine, &tmpl, &filter, workers ? &pool : NULL, fd, name, opts, &out);
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+    }
+    output_flush(&out);
+    if (workers) {
+        stop_pool(&pool, workers, started, &filter);
+        free(workers);
+    }
+    if (opts->stats) {
+        unsigned long total = filter.lines + filter.skipped;
+        fprintf(stderr, "esub: %lu of %lu lines skipped by the prefilter (%.1f%%)", filter.skipped, total,
+                total ? 100.0 * filter.skipped / total : 0.0);
+        for (int i = 0; i < filter.count; i++) {
+            fprintf(stderr, "%s\"%.*s\"", i ? " " : ", needles ", (int)filter.lens[i], filter.needles[i]);
+        }
+        fprintf(stderr, "\n");
+        if (opts->in_place) {
+            fprintf(stderr, "esub: %d of %d files rewritten\n", edited, opts->ninputs);
+        }
     }
-    printf("\n");
     
-    regfree(&regex);
-    return 0;
+    free_template(&tmpl);
+    engine.release(engine.impl);
+    return result || out.error;
 }
 
-int parse_arguments(int argc, char* argv[], char** regexp, char** substitution, char** input_string, int* use_color) {
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--color") == 0) {
-            *use_color = 1;
+int parse_arguments(int argc, char* argv[], struct options* opts) {
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--color") == 0) {
+            opts->color = COLOR_ALWAYS;
+        } else if (strncmp(argv[i], "--color=", 8) == 0) {
+            const char* when = argv[i] + 8;
+            if (strcmp(when, "always") == 0) {
+                opts->color = COLOR_ALWAYS;
+            } else if (strcmp(when, "never") == 0) {
+                opts->color = COLOR_NEVER;
+            } else if (strcmp(when, "auto") == 0) {
+                opts->color = COLOR_AUTO;
+            } else {
+                fprintf(stderr, "Error: --color takes always, never or auto, not %s\n", when);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-g") == 0 || strcmp(argv[i], "--global") == 0) {
+            opts->global = 1;
+        } else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--files") == 0) {
+            opts->files = 1;
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--stats") == 0) {
+            opts->stats = 1;
+        } else if (strcmp(argv[i], "-E") == 0 || strcmp(argv[i], "--engine") == 0) {
+            const char* name = i + 1 < argc ? argv[++i] : "";
+            if (strcmp(name, "posix") == 0) {
+                opts->engine = ENGINE_POSIX;
+            } else if (strcmp(name, "dfa") == 0) {
+                opts->engine = ENGINE_DFA;
+            } else {
+                fprintf(stderr, "Error: Unknown engine: %s\n", name);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) {
+            char* end = NULL;
+            long jobs = i + 1 < argc ? strtol(argv[++i], &end, 10) : 0;
+            if (!end || *end || jobs < 1 || jobs > 1024) {
+                fprintf(stderr, "Error: --jobs needs a number of threads from 1 to 1024\n");
+                return 1;
+            }
+            opts->jobs = jobs;
+        } else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--in-place") == 0) {
+            opts->in_place = 1;
+            opts->files = 1;
         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             return -1;
-        } else if (argv[i][0] == '-') {
+        } else {
             fprintf(stderr, "Error: Unknown option: %s\n", argv[i]);
             return 1;
         }
     }
-    if (argc < 4 + *use_color) {
-        fprintf(stderr, "Error: need 3 arguments, see help\n");
+    if (argc - i < 2 || (argc - i > 3 && !opts->files)) {
+        fprintf(stderr, "Error: need regexp, substitution and a string (or input on stdin), see help\n");
         return 1;
     }
-    *regexp = argv[1 + *use_color];
-    *substitution = argv[2 + *use_color];
-    *input_string = argv[3 + *use_color];
+    opts->regexp = argv[i];
+    opts->substitution = argv[i + 1];
+    opts->inputs = argv + i + 2;
+    opts->ninputs = argc - i - 2;
+    if (opts->in_place && opts->ninputs == 0) {
+        fprintf(stderr, "Error: --in-place needs files\n");
+        return 1;
+    }
+    for (int j = 0; opts->in_place && j < opts->ninputs; j++) {
+        if (strcmp(opts->inputs[j], "-") == 0) {
+            fprintf(stderr, "Error: cannot edit standard input in place\n");
+            return 1;
+        }
+    }
+    // Files edited in place never get escape sequences
+    opts->use_color = !opts->in_place &&
+                      (opts->color == COLOR_ALWAYS || (opts->color == COLOR_AUTO && isatty(STDOUT_FILENO)));
+    if (opts->files && opts->ninputs == 0) {
+        static char* standard_input[] = {"-"};
+        opts->inputs = standard_input;
+        opts->ninputs = 1;
+    }
     return 0;
 }
 
 int main(int argc, char* argv[]) {
-    char* regexp;
-    char* substitution;
-    char* input_string;
-    int use_color = 0;
+    struct options opts = {0};
     
-    int parse_args_res = parse_arguments(argc, argv, &regexp, &substitution, &input_string, &use_color);
+    int parse_args_res = parse_arguments(argc, argv, &opts);
     if (parse_args_res == -1) {
         printf("Usage: esub [OPTIONS] regexp substitution [string]\n");
+        printf("       esub [OPTIONS] -f regexp substitution [file...]\n");
+        printf("Without a string (or with -f), input is read line by line from stdin or files.\n");
+        printf("In the substitution \\N or \\{N} is group N, \\{name} the group written (?<name>...).\n");
         printf("Options:\n\
-        -c, --color    Colorize capture groups in output\n\
+        -c, --color    Colorize capture groups in output (same as --color=always)\n\
+        --color=WHEN   Colorize always, never or auto (only when output is a terminal)\n\
+        -g, --global   Replace every match, not only the first one\n\
+        -f, --files    Arguments after substitution are files ('-' for stdin)\n\
+        -i, --in-place Edit the files (implies -f); files without a match are left alone\n\
+        -j, --jobs N   With -f, substitute big files on N threads\n\
+        -s, --stats    Report how many lines the literal prefilter skipped\n\
+        -E, --engine NAME  Regexp engine: posix (glibc, the default) or dfa (built-in,\n\
+                       no backtracking, no back-references)\n\
         -h, --help     Show this help message\n\n");
         return 1;
-    } else if (parse_args_res != 0 || !substitution || !input_string || !regexp) {
+    } else if (parse_args_res != 0 || !opts.substitution || !opts.regexp) {
         fprintf(stderr, "Error in parsing");
         return 1;
     }
 
-    int result = replace(input_string, regexp, substitution, use_color);
+    int result = replace(&opts);
     
     return result == 0 ? 0 : 1;
-}
\ No newline at end of file
+}
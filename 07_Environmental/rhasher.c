@@ -1,8 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <rhash.h>
 
 // #define USE_READLINE
@@ -14,33 +24,627 @@
 
 #define MAX_LINE_LENGTH 1024
 #define MAX_HASH_LENGTH 130
+#define JOBS_PER_WORKER 4
+#define MAX_ALGORITHMS 3
+#define READ_ALIGNMENT 4096
+#define MB (1024 * 1024)
+#define MAX_DIGEST_SIZE 64
+#define MAX_CONTEXTS ((1 << MAX_ALGORITHMS) - 1)
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define TTH_LEAF 1024
+#define TIGER_SIZE 24
+#define MAX_TREE_DEPTH 64
+#define CACHE_MAGIC "RHCACHE1"
+#define CACHE_SLOTS (1 << 16)
+#define CACHE_PROBES 8
 
-void compute_hash(const char *algorithm, const char *input, int is_file, int uppercase) {
-    unsigned char output[MAX_HASH_LENGTH];
-    char formatted_output[MAX_HASH_LENGTH];
-    int output_format = (uppercase ? RHPR_HEX: RHPR_BASE64);
-    
-    int hash_id;
-    if (strcasecmp(algorithm, "MD5") == 0) {
-        hash_id = RHASH_MD5;
-    } else if (strcasecmp(algorithm, "SHA1") == 0) {
-        hash_id = RHASH_SHA1;
-    } else if (strcasecmp(algorithm, "TTH") == 0) {
-        hash_id = RHASH_TTH;
-    } else {
-        fprintf(stderr, "Error: Unknown algorithm '%s'\n", algorithm);
+// Algorithms requested by one command, e.g. "MD5,sha1,TTH". As for a single
+// algorithm, a capitalized name prints hex and a lowercase one base64.
+struct algorithms {
+    int count;
+    unsigned ids[MAX_ALGORITHMS];
+    int formats[MAX_ALGORITHMS];
+    const char *names[MAX_ALGORITHMS];
+    unsigned mask;
+};
+
+unsigned algorithm_id(const char *algorithm, size_t len) {
+    static const struct {
+        const char *name;
+        unsigned id;
+    } known[] = {{"MD5", RHASH_MD5}, {"SHA1", RHASH_SHA1}, {"TTH", RHASH_TTH}};
+    for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+        if (strlen(known[i].name) == len && strncasecmp(algorithm, known[i].name, len) == 0) {
+            return known[i].id;
+        }
+    }
+    return 0;
+}
+
+int parse_algorithms(const char *list, struct algorithms *algs) {
+    algs->count = 0;
+    algs->mask = 0;
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        unsigned id = algorithm_id(list, len);
+        if (!id) {
+            fprintf(stderr, "Error: Unknown algorithm '%.*s'\n", (int)len, list);
+            return -1;
+        }
+        if (!(algs->mask & id)) {
+            algs->ids[algs->count] = id;
+            algs->formats[algs->count] = isupper((unsigned char)list[0]) ? RHPR_HEX : RHPR_BASE64;
+            algs->names[algs->count] = rhash_get_name(id);
+            algs->count++;
+            algs->mask |= id;
+        }
+        list += len;
+        list += *list == ',';
+    }
+    if (algs->count == 0) {
+        fprintf(stderr, "Error: Missing algorithm\n");
+        return -1;
+    }
+    return 0;
+}
+
+// File reading setup, shared by the REPL and every batch worker
+struct io_options {
+    size_t buffer_size;
+    int direct;
+    int stats;
+    int tree_threads;
+} io_options = {4 * MB, 0, 0, 1};
+
+// Two aligned read buffers and reusable hashing contexts, one set per thread that hashes
+struct io_buffers {
+    unsigned char *data[2];
+    unsigned masks[MAX_CONTEXTS];
+    rhash contexts[MAX_CONTEXTS];
+};
+
+struct timing {
+    unsigned long long bytes;
+    double seconds;
+};
+
+int io_buffers_init(struct io_buffers *io) {
+    memset(io, 0, sizeof(*io));
+    for (int i = 0; i < 2; i++) {
+        if (posix_memalign((void **)&io->data[i], READ_ALIGNMENT, io_options.buffer_size) != 0) {
+            io->data[i] = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void io_buffers_free(struct io_buffers *io) {
+    free(io->data[0]);
+    free(io->data[1]);
+    for (int i = 0; i < MAX_CONTEXTS && io->contexts[i]; i++) {
+        rhash_free(io->contexts[i]);
+    }
+}
+
+// A fresh context for the algorithms in `mask`, reset rather than allocated
+// again when this set of algorithms was used before
+rhash io_context(struct io_buffers *io, unsigned mask) {
+    for (int i = 0; i < MAX_CONTEXTS; i++) {
+        if (io->contexts[i] && io->masks[i] == mask) {
+            rhash_reset(io->contexts[i]);
+            return io->contexts[i];
+        } else if (!io->contexts[i]) {
+            io->masks[i] = mask;
+            return io->contexts[i] = rhash_init(mask);
+        }
+    }
+    return NULL;
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill as much of `buffer` as the file has; with O_DIRECT a read the file
+// system refuses (unaligned tail, unsupported file system) is retried buffered.
+// A negative `offset` reads at the file position, otherwise at `offset`.
+ssize_t read_block(int fd, unsigned char *buffer, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = offset < 0 ? read(fd, buffer + done, size - done)
+                                 : pread(fd, buffer + done, size - done, offset + done);
+        if (got < 0 && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            continue;
+        } else if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got < 0) {
+            return -1;
+        } else if (got == 0) {
+            break;
+        }
+        done += got;
+    }
+    return done;
+}
+
+// Double buffering: a reader thread fills one buffer while the caller hashes the other
+struct stream {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    struct io_buffers *io;
+    int full[2];
+    ssize_t length[2];
+};
+
+void *stream_reader(void *arg) {
+    struct stream *st = arg;
+    for (int i = 0;; i ^= 1) {
+        pthread_mutex_lock(&st->lock);
+        while (st->full[i]) {
+            pthread_cond_wait(&st->cond, &st->lock);
+        }
+        pthread_mutex_unlock(&st->lock);
+        
+        ssize_t got = read_block(st->fd, st->io->data[i], io_options.buffer_size, -1);
+        
+        pthread_mutex_lock(&st->lock);
+        st->length[i] = got;
+        st->full[i] = 1;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+        if (got <= 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+int hash_fd(rhash ctx, int fd, struct io_buffers *io, unsigned long long *bytes) {
+    struct stat st;
+    ssize_t got;
+    // Files that fit into one buffer are not worth a thread
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size < io_options.buffer_size) {
+        while ((got = read_block(fd, io->data[0], io_options.buffer_size, -1)) > 0) {
+            rhash_update(ctx, io->data[0], got);
+            *bytes += got;
+        }
+        return got < 0 ? -1 : 0;
+    }
+    
+    struct stream stream = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .fd = fd,
+        .io = io,
+    };
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, stream_reader, &stream) != 0) {
+        return -1;
+    }
+    for (int i = 0;; i ^= 1) {
+        pthread_mutex_lock(&stream.lock);
+        while (!stream.full[i]) {
+            pthread_cond_wait(&stream.cond, &stream.lock);
+        }
+        got = stream.length[i];
+        pthread_mutex_unlock(&stream.lock);
+        if (got <= 0) {
+            break;
+        }
+        
+        rhash_update(ctx, io->data[i], got);
+        *bytes += got;
+        
+        pthread_mutex_lock(&stream.lock);
+        stream.full[i] = 0;
+        pthread_cond_broadcast(&stream.cond);
+        pthread_mutex_unlock(&stream.lock);
+    }
+    pthread_join(reader, NULL);
+    return got < 0 ? -1 : 0;
+}
+
+// Standard input goes through stdio: the REPL may already have buffered some of it
+int hash_stdin(rhash ctx, struct io_buffers *io, unsigned long long *bytes) {
+    size_t got;
+    while ((got = fread(io->data[0], 1, io_options.buffer_size, stdin)) > 0) {
+        rhash_update(ctx, io->data[0], got);
+        *bytes += got;
+    }
+    int result = ferror(stdin) ? -1 : 0;
+    clearerr(stdin);
+    return result;
+}
+
+int open_input(const char *path) {
+    int fd = -1;
+    if (io_options.direct) {
+        fd = open(path, O_RDONLY | O_DIRECT);
+    }
+    if (fd < 0) {
+        fd = open(path, O_RDONLY);
+    }
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return fd;
+}
+
+// Tiger tree hash (TTH) of one big file on several threads. TTH hashes
+// 0x00 + every 1024-byte leaf with Tiger, then 0x01 + left + right up the tree,
+// promoting an odd last node as is. A chunk of 2^k leaves starting at a multiple
+// of 2^k leaves is a whole subtree, so chunks are hashed independently (read with
+// pread) and their roots are combined into the same tree afterwards.
+struct tree_stack {
+    int depth;
+    int levels[MAX_TREE_DEPTH];
+    unsigned char hashes[MAX_TREE_DEPTH][TIGER_SIZE];
+};
+
+struct tree {
+    int fd;
+    off_t size;
+    size_t chunk;
+    size_t nchunks;
+    size_t next;
+    unsigned char (*roots)[TIGER_SIZE];
+    int error;
+};
+
+void tiger_node(rhash ctx, unsigned char prefix, const void *data, size_t len, const void *more, size_t more_len,
+                unsigned char *out) {
+    rhash_reset(ctx);
+    rhash_update(ctx, &prefix, 1);
+    rhash_update(ctx, data, len);
+    if (more_len) {
+        rhash_update(ctx, more, more_len);
+    }
+    rhash_final(ctx, out);
+}
+
+// Add the next node at `level` from the left, joining equal levels as they complete
+void tree_push(rhash ctx, struct tree_stack *s, const unsigned char *hash, int level) {
+    memcpy(s->hashes[s->depth], hash, TIGER_SIZE);
+    s->levels[s->depth++] = level;
+    while (s->depth > 1 && s->levels[s->depth - 1] == s->levels[s->depth - 2]) {
+        s->depth--;
+        tiger_node(ctx, 1, s->hashes[s->depth - 1], TIGER_SIZE, s->hashes[s->depth], TIGER_SIZE, s->hashes[s->depth - 1]);
+        s->levels[s->depth - 1]++;
+    }
+}
+
+// Join what is left right to left, which is where the promoted nodes end up
+void tree_root(rhash ctx, struct tree_stack *s, unsigned char *root) {
+    while (s->depth > 1) {
+        s->depth--;
+        tiger_node(ctx, 1, s->hashes[s->depth - 1], TIGER_SIZE, s->hashes[s->depth], TIGER_SIZE, s->hashes[s->depth - 1]);
+    }
+    memcpy(root, s->hashes[0], TIGER_SIZE);
+}
+
+void *tree_worker(void *arg) {
+    struct tree *t = arg;
+    unsigned char *buffer = NULL, leaf[TIGER_SIZE];
+    rhash ctx = rhash_init(RHASH_TIGER);
+    if (!ctx || posix_memalign((void **)&buffer, READ_ALIGNMENT, t->chunk) != 0) {
+        t->error = 1;
+        buffer = NULL;
+    }
+    size_t i;
+    while (!t->error && (i = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED)) < t->nchunks) {
+        off_t offset = (off_t)i * t->chunk;
+        size_t len = t->size - offset < (off_t)t->chunk ? (size_t)(t->size - offset) : t->chunk;
+        if (read_block(t->fd, buffer, len, offset) != (ssize_t)len) {
+            t->error = 1;
+            break;
+        }
+        struct tree_stack s = {0};
+        for (size_t at = 0; at < len; at += TTH_LEAF) {
+            tiger_node(ctx, 0, buffer + at, len - at < TTH_LEAF ? len - at : TTH_LEAF, NULL, 0, leaf);
+            tree_push(ctx, &s, leaf, 0);
+        }
+        tree_root(ctx, &s, t->roots[i]);
+    }
+    if (ctx) {
+        rhash_free(ctx);
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Chunks are the largest power of two of leaves that fits the read buffer
+size_t tree_chunk(void) {
+    size_t chunk = TTH_LEAF;
+    while (chunk * 2 <= io_options.buffer_size) {
+        chunk *= 2;
+    }
+    return chunk;
+}
+
+int tth_parallel(int fd, off_t size, unsigned char *root) {
+    struct tree t = {.fd = fd, .size = size, .chunk = tree_chunk()};
+    t.nchunks = (size + t.chunk - 1) / t.chunk;
+    int threads = io_options.tree_threads;
+    pthread_t *workers = calloc(threads, sizeof(*workers));
+    t.roots = calloc(t.nchunks, sizeof(*t.roots));
+    rhash ctx = rhash_init(RHASH_TIGER);
+    if (!workers || !t.roots || !ctx) {
+        t.error = 1;
+        threads = 0;
+    }
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, tree_worker, &t) != 0) {
+            threads = i;
+            break;
+        }
+    }
+    if (threads == 0 && !t.error) {
+        tree_worker(&t);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    if (!t.error) {
+        struct tree_stack s = {0};
+        for (size_t i = 0; i < t.nchunks; i++) {
+            tree_push(ctx, &s, t.roots[i], 0);
+        }
+        tree_root(ctx, &s, root);
+    }
+    if (ctx) {
+        rhash_free(ctx);
+    }
+    free(t.roots);
+    free(workers);
+    return t.error ? -1 : 0;
+}
+
+// Digest cache: a file of fixed-size records forming an open-addressing hash
+// table, mapped into memory and shared by all threads and rhasher processes.
+// A record is keyed by everything that changes when a file is rewritten.
+struct cache_record {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t hash_id;
+    uint32_t digest_size;
+    unsigned char digest[MAX_DIGEST_SIZE];
+};
+
+struct cache_header {
+    char magic[8];
+    uint64_t slots;
+};
+
+struct cache {
+    pthread_mutex_t lock;
+    int fd;
+    struct cache_header *header;
+    struct cache_record *records;
+    size_t map_size;
+    int verify;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stale;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+
+int cache_open(const char *path) {
+    cache.map_size = sizeof(struct cache_header) + CACHE_SLOTS * sizeof(struct cache_record);
+    if ((cache.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        return -1;
+    }
+    struct stat st;
+    struct cache_header header;
+    int ok = 1;
+    flock(cache.fd, LOCK_EX);
+    if (fstat(cache.fd, &st) < 0 || st.st_size != (off_t)cache.map_size ||
+        pread(cache.fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, CACHE_MAGIC, 8) != 0 || header.slots != CACHE_SLOTS) {
+        // New or foreign file: start over with an empty (sparse) table
+        memcpy(header.magic, CACHE_MAGIC, 8);
+        header.slots = CACHE_SLOTS;
+        ok = ftruncate(cache.fd, 0) == 0 && ftruncate(cache.fd, cache.map_size) == 0 &&
+             pwrite(cache.fd, &header, sizeof(header), 0) == sizeof(header);
+    }
+    flock(cache.fd, LOCK_UN);
+    if (ok) {
+        cache.header = mmap(NULL, cache.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache.fd, 0);
+    }
+    if (!ok || cache.header == MAP_FAILED) {
+        cache.header = NULL;
+        close(cache.fd);
+        cache.fd = -1;
+        return -1;
+    }
+    cache.records = (struct cache_record *)(cache.header + 1);
+    return 0;
+}
+
+void cache_close(void) {
+    if (cache.header) {
+        munmap(cache.header, cache.map_size);
+        close(cache.fd);
+        cache.header = NULL;
+        cache.records = NULL;
+    }
+}
+
+size_t cache_slot(const struct stat *st, unsigned hash_id) {
+    uint64_t h = 14695981039346656037ULL;
+    uint64_t key[] = {st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec, hash_id};
+    for (size_t i = 0; i < sizeof(key) / sizeof(key[0]); i++) {
+        h = (h ^ key[i]) * 1099511628211ULL;
+    }
+    return (h ^ (h >> 32)) % CACHE_SLOTS;
+}
+
+int cache_match(const struct cache_record *r, const struct stat *st, unsigned hash_id) {
+    return r->hash_id == hash_id && r->dev == (uint64_t)st->st_dev && r->ino == (uint64_t)st->st_ino &&
+           r->size == (uint64_t)st->st_size && r->mtime_sec == st->st_mtim.tv_sec &&
+           r->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+// Copy the cached raw digest of a file into `digest`, returns its size or 0
+size_t cache_lookup(const struct stat *st, unsigned hash_id, unsigned char *digest) {
+    size_t size = 0, slot = cache_slot(st, hash_id);
+    pthread_mutex_lock(&cache.lock);
+    flock(cache.fd, LOCK_SH);
+    for (int i = 0; i < CACHE_PROBES; i++) {
+        const struct cache_record *r = &cache.records[(slot + i) % CACHE_SLOTS];
+        if (cache_match(r, st, hash_id)) {
+            size = r->digest_size;
+            memcpy(digest, r->digest, size);
+            break;
+        }
+    }
+    flock(cache.fd, LOCK_UN);
+    pthread_mutex_unlock(&cache.lock);
+    return size;
+}
+
+void cache_store(const struct stat *st, unsigned hash_id, const unsigned char *digest, size_t size) {
+    // A file changed in the same second as its mtime could change again unnoticed
+    if (st->st_mtim.tv_sec >= time(NULL) - 1 || size > MAX_DIGEST_SIZE) {
         return;
     }
+    size_t slot = cache_slot(st, hash_id);
+    pthread_mutex_lock(&cache.lock);
+    flock(cache.fd, LOCK_EX);
+    // Reuse the record of this file, else the first free one, else evict the first probed
+    struct cache_record *r = &cache.records[slot];
+    for (int i = 0; i < CACHE_PROBES; i++) {
+        struct cache_record *probe = &cache.records[(slot + i) % CACHE_SLOTS];
+        if (cache_match(probe, st, hash_id)) {
+            r = probe;
+            break;
+        } else if (probe->hash_id == 0 && r->hash_id != 0) {
+            r = probe;
+        }
+    }
+    *r = (struct cache_record){
+        .dev = st->st_dev,
+        .ino = st->st_ino,
+        .size = st->st_size,
+        .mtime_sec = st->st_mtim.tv_sec,
+        .mtime_nsec = st->st_mtim.tv_nsec,
+        .hash_id = hash_id,
+        .digest_size = size,
+    };
+    memcpy(r->digest, digest, size);
+    flock(cache.fd, LOCK_UN);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Hash a file, stdin ("-") or a string of `len` bytes (which may contain NULs)
+// with all requested algorithms in one pass: every block read feeds all digests.
+int hash_input(const struct algorithms *algs, const char *input, size_t len, int is_file,
+               struct io_buffers *io, char digests[][MAX_HASH_LENGTH], struct timing *timing) {
+    unsigned char raw[MAX_ALGORITHMS][MAX_DIGEST_SIZE], fresh[MAX_ALGORITHMS][MAX_DIGEST_SIZE];
+    size_t cached[MAX_ALGORITHMS] = {0};
+    unsigned missing = algs->mask;
+    double start = now();
+    int result = 0, fd = -1, from_stdin = is_file && strcmp(input, "-") == 0, regular = 0;
+    struct stat st;
+    timing->bytes = 0;
     
+    if (from_stdin) {
+        fd = STDIN_FILENO;
+    } else if (is_file) {
+        if ((fd = open_input(input)) < 0 || fstat(fd, &st) < 0) {
+            result = -1;
+        } else if ((regular = S_ISREG(st.st_mode)) && cache.records) {
+            for (int i = 0; i < algs->count; i++) {
+                if ((cached[i] = cache_lookup(&st, algs->ids[i], raw[i]))) {
+                    missing &= ~algs->ids[i];
+                }
+            }
+            if (cache.verify) {
+                missing = algs->mask;
+            }
+        }
+    }
     
-    int result;
-    if (is_file) {
-        result = rhash_file(hash_id, input, output);
-    } else {
-        result = rhash_msg(hash_id, input, strlen(input), output);
+    rhash ctx = NULL;
+    if (result == 0 && missing == RHASH_TTH && regular && io_options.tree_threads > 1 &&
+        st.st_size > (off_t)tree_chunk()) {
+        for (int i = 0; i < algs->count; i++) {
+            if (algs->ids[i] == RHASH_TTH) {
+                result = tth_parallel(fd, st.st_size, fresh[i]);
+            }
+        }
+        timing->bytes = st.st_size;
+    } else if (result == 0 && missing) {
+        if (!(ctx = io_context(io, missing))) {
+            result = -1;
+        } else if (from_stdin) {
+            result = hash_stdin(ctx, io, &timing->bytes);
+        } else if (is_file) {
+            result = hash_fd(ctx, fd, io, &timing->bytes);
+        } else {
+            timing->bytes = len;
+            rhash_update(ctx, input, len);
+        }
+    }
+    if (result == 0 && ctx) {
+        rhash_final(ctx, NULL);
+        for (int i = 0; i < algs->count; i++) {
+            if (missing & algs->ids[i]) {
+                rhash_print((char *)fresh[i], ctx, algs->ids[i], RHPR_RAW);
+            }
+        }
     }
     
-    if (result < 0) {
+    for (int i = 0; result == 0 && i < algs->count; i++) {
+        unsigned id = algs->ids[i];
+        size_t size = rhash_get_digest_size(id);
+        if (missing & id) {
+            if (cached[i] && (cached[i] != size || memcmp(fresh[i], raw[i], size) != 0)) {
+                fprintf(stderr, "Warning: cached %s digest of '%s' was wrong\n", algs->names[i], input);
+                __atomic_add_fetch(&cache.stale, 1, __ATOMIC_RELAXED);
+            }
+            memcpy(raw[i], fresh[i], size);
+            if (cache.records && regular) {
+                __atomic_add_fetch(&cache.misses, 1, __ATOMIC_RELAXED);
+                cache_store(&st, id, fresh[i], size);
+            }
+        } else {
+            __atomic_add_fetch(&cache.hits, 1, __ATOMIC_RELAXED);
+        }
+        rhash_print_bytes(digests[i], raw[i], size, algs->formats[i]);
+    }
+    if (fd >= 0 && !from_stdin) {
+        close(fd);
+    }
+    timing->seconds = now() - start;
+    return result;
+}
+
+void print_timing(const char *input, const struct timing *timing) {
+    double speed = timing->seconds > 0 ? timing->bytes / timing->seconds / MB : 0;
+    fprintf(stderr, "%s: %llu bytes in %.3f s, %.1f MB/s\n", input, timing->bytes, timing->seconds, speed);
+}
+
+void compute_hash(const char *algorithm, const char *input, size_t len, int is_file) {
+    static struct io_buffers io;
+    char digests[MAX_ALGORITHMS][MAX_HASH_LENGTH];
+    struct algorithms algs;
+    struct timing timing;
+    if (parse_algorithms(algorithm, &algs) < 0) {
+        return;
+    }
+    if (!io.data[0] && io_buffers_init(&io) < 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return;
+    }
+    
+    if (hash_input(&algs, input, len, is_file, &io, digests, &timing) < 0) {
         if (is_file) {
             fprintf(stderr, "Error: Cannot open or read file '%s'\n", input);
         } else {
@@ -49,94 +653,521 @@ void compute_hash(const char *algorithm, const char *input, int is_file, int upp
         return;
     }
     
-    if (rhash_print_bytes(formatted_output, output, rhash_get_digest_size(hash_id), output_format) < 0) {
-        fprintf(stderr, "Error: Failed to format hash output\n");
-        return;
+    if (algs.count == 1) {
+        printf("%s\n", digests[0]);
+    } else {
+        for (int i = 0; i < algs.count; i++) {
+            printf("%s %s\n", algs.names[i], digests[i]);
+        }
+    }
+    if (io_options.stats && is_file) {
+        fflush(stdout);
+        print_timing(input, &timing);
     }
-    
-    printf("%s\n", formatted_output);
 }
 
-void process_command(const char *line) {
-    char * token;
-    char * line_copy = strdup(line);
-    if (!line_copy) return;
-    token = strtok(line_copy, " \t\n");
-    if (!token) {
-        free(line_copy);
+// Take the argument at *cursor, unescaping it in place: a "quoted string" with
+// \" \\ \n \r \t \0 and \xHH escapes, or a bare word (a file name, "-" for stdin)
+// where a backslash keeps the next character, e.g. a space. Returns NULL and
+// sets *error on a syntax error.
+char *parse_argument(char **cursor, size_t *len, int *quoted, const char **error) {
+    char *in = *cursor + strspn(*cursor, " \t"), *out, *start;
+    if (!*in) {
+        *error = "Missing input";
+        return NULL;
+    }
+    *quoted = *in == '"';
+    in += *quoted;
+    start = out = in;
+    while (*in && (*quoted ? *in != '"' : !isspace((unsigned char)*in))) {
+        if (*in != '\\') {
+            *out++ = *in++;
+        } else if (!*++in) {
+            break;
+        } else if (!*quoted) {
+            *out++ = *in++;
+        } else if (strchr("\"\\", *in)) {
+            *out++ = *in++;
+        } else if (strchr("nrt0", *in)) {
+            *out++ = *in == 'n' ? '\n' : *in == 'r' ? '\r' : *in == 't' ? '\t' : '\0';
+            in++;
+        } else if (*in == 'x' && isxdigit((unsigned char)in[1])) {
+            int digits = isxdigit((unsigned char)in[2]) ? 2 : 1;
+            char hex[3] = {in[1], digits == 2 ? in[2] : '\0', '\0'};
+            *out++ = (char)strtol(hex, NULL, 16);
+            in += 1 + digits;
+        } else {
+            *error = "Unknown escape sequence in string";
+            return NULL;
+        }
+    }
+    if (*quoted && *in != '"') {
+        *error = "Unterminated string";
+        return NULL;
+    }
+    // Step over the closing quote or separator before it can be overwritten
+    *cursor = *in ? in + 1 : in;
+    *len = out - start;
+    *out = '\0';
+    return start;
+}
+
+// Parse the command in place: `line` belongs to the caller and is reused
+void process_command(char *line) {
+    char *cursor = line + strspn(line, " \t\n");
+    if (!*cursor) {
         return;
     }
+    char *algorithm = cursor;
+    cursor += strcspn(cursor, " \t\n");
+    if (*cursor) {
+        *cursor++ = '\0';
+    }
     
-    char *algorithm = token;
-    int uppercase = isupper((unsigned char)algorithm[0]);
-    token = strtok(NULL, " \t\n");
-    if (!token) {
-        fprintf(stderr, "Error: Missing input\n");
-        free(line_copy);
+    size_t len;
+    int quoted;
+    const char *error = NULL;
+    char *input = parse_argument(&cursor, &len, &quoted, &error);
+    if (input && cursor[strspn(cursor, " \t\n")]) {
+        error = "Unexpected text after input";
+    }
+    if (!input || error) {
+        fprintf(stderr, "Error: %s\n", error);
         return;
     }
     
-    char *input = token;
-    int is_file = 1;
+    compute_hash(algorithm, input, len, !quoted);
+}
+
+// Batch mode: files are hashed on a pool of workers, results come out in input order.
+// At most JOBS_PER_WORKER files per worker are queued or waiting to be printed.
+struct job {
+    char *path;
+    struct algorithms algs;
+    char expected[MAX_HASH_LENGTH];
+    char digests[MAX_ALGORITHMS][MAX_HASH_LENGTH];
+    struct timing timing;
+    int result;
+    int done;
+};
+
+// Where jobs come from: command line files, paths on stdin or, when checking,
+// the lines of a manifest
+struct source {
+    char **files;
+    int nfiles;
+    int next;
+    FILE *list;
+    int check;
+    int have_algs;
+    struct algorithms algs;
+    unsigned long bad_lines;
+};
+
+struct batch {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct job *jobs;
+    size_t window;
+    size_t queued;
+    size_t taken;
+    size_t printed;
+    int eof;
+};
+
+void *batch_worker(void *arg) {
+    struct batch *b = arg;
+    struct io_buffers io;
+    int ready = io_buffers_init(&io) == 0;
     
-    if (input[0] == '"') {
-        is_file = 0;
-        input++;
-        size_t len = strlen(input);
-        if (len > 0 && input[len-1] == '"') {
-            input[len-1] = '\0';
+    pthread_mutex_lock(&b->lock);
+    while (1) {
+        while (b->taken == b->queued && !b->eof) {
+            pthread_cond_wait(&b->cond, &b->lock);
         }
+        if (b->taken == b->queued) {
+            break;
+        }
+        struct job *job = &b->jobs[b->taken++ % b->window];
+        pthread_mutex_unlock(&b->lock);
+        
+        job->result = ready ? hash_input(&job->algs, job->path, 0, 1, &io, job->digests, &job->timing) : -1;
+        
+        pthread_mutex_lock(&b->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&b->cond);
+    }
+    pthread_mutex_unlock(&b->lock);
+    io_buffers_free(&io);
+    return NULL;
+}
+
+// Encoding of a digest as written in a manifest: hex or base64 of the right length
+int digest_format(const char *digest, unsigned id) {
+    size_t len = strlen(digest), size = rhash_get_digest_size(id);
+    if (len == 2 * size && strspn(digest, "0123456789abcdefABCDEF") == len) {
+        return RHPR_HEX;
+    } else if (len == 4 * ((size + 2) / 3)) {
+        return RHPR_BASE64;
     }
+    return 0;
+}
+
+// Fill `job` from one manifest line, either BSD tag style "SHA1 (path) = digest"
+// or sha1sum style "digest  path" / "digest *path", where a leading backslash
+// means \\ and \n escapes in the path. Returns -1 for a malformed line.
+int parse_manifest_line(struct source *src, char *line, struct job *job) {
+    static const unsigned guesses[] = {RHASH_MD5, RHASH_SHA1, RHASH_TTH};
+    char *name = line, *digest, *path, *sep;
+    unsigned id = 0;
+    size_t name_len = strcspn(line, " ");
     
-    compute_hash(algorithm, input, is_file, uppercase);
-    free(line_copy);
+    if (line[name_len] == ' ' && line[name_len + 1] == '(' && (sep = strstr(line, ") = ")) &&
+        !strstr(sep + 4, ") = ") && (id = algorithm_id(name, name_len))) {
+        path = line + name_len + 2;
+        *sep = '\0';
+        digest = sep + 4;
+    } else {
+        int escaped = *line == '\\';
+        digest = line + escaped;
+        sep = digest + strcspn(digest, " ");
+        if (sep[0] != ' ' || (sep[1] != ' ' && sep[1] != '*') || !sep[2]) {
+            return -1;
+        }
+        *sep = '\0';
+        path = sep + 2;
+        if (escaped) {
+            char *out = path;
+            for (char *in = path; *in; in++) {
+                if (*in == '\\' && (in[1] == '\\' || in[1] == 'n')) {
+                    *out++ = *++in == 'n' ? '\n' : '\\';
+                } else {
+                    *out++ = *in;
+                }
+            }
+            *out = '\0';
+        }
+        if (src->have_algs) {
+            id = src->algs.ids[0];
+        }
+        for (size_t i = 0; !id && i < sizeof(guesses) / sizeof(guesses[0]); i++) {
+            if (digest_format(digest, guesses[i])) {
+                id = guesses[i];
+            }
+        }
+    }
+    int format = id ? digest_format(digest, id) : 0;
+    if (!format || !*path || strlen(digest) >= MAX_HASH_LENGTH) {
+        return -1;
+    }
+    job->algs = (struct algorithms){
+        .count = 1,
+        .ids = {id},
+        .formats = {format},
+        .names = {rhash_get_name(id)},
+        .mask = id,
+    };
+    strcpy(job->expected, digest);
+    job->path = strdup(path);
+    return job->path ? 0 : -1;
+}
+
+// Next job: a file from the command line, a path per line of the list, or
+// a manifest entry. Returns 0 at the end of input.
+int next_job(struct source *src, struct job *job) {
+    if (!src->list) {
+        if (src->next >= src->nfiles || !(job->path = strdup(src->files[src->next++]))) {
+            return 0;
+        }
+        job->algs = src->algs;
+        return 1;
+    }
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    while ((read = getline(&line, &len, src->list)) != -1) {
+        while (read > 0 && (line[read-1] == '\n' || line[read-1] == '\r')) {
+            line[--read] = '\0';
+        }
+        if (read == 0 || (src->check && line[0] == '#')) {
+            continue;
+        } else if (!src->check) {
+            job->path = line;
+            job->algs = src->algs;
+            return 1;
+        } else if (parse_manifest_line(src, line, job) == 0) {
+            free(line);
+            return 1;
+        }
+        src->bad_lines++;
+    }
+    free(line);
+    return 0;
+}
+
+// Start reading the head of a file that is queued but not yet being hashed
+void prefetch(const char *path) {
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, io_options.buffer_size, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
 }
 
-int main() {
-    #ifdef USE_READLINE
-        char *line = NULL;
-    #else
-        char *line = NULL;
-        size_t len = 0;
-        ssize_t read;
-    #endif
+int run_batch(struct source *src, int workers) {
+    struct batch b = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    b.window = (size_t)workers * JOBS_PER_WORKER;
+    b.jobs = calloc(b.window, sizeof(*b.jobs));
+    pthread_t *threads = calloc(workers, sizeof(*threads));
+    if (!b.jobs || !threads) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(b.jobs);
+        free(threads);
+        return 1;
+    }
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, batch_worker, &b) != 0) {
+            fprintf(stderr, "Error: Cannot start worker thread\n");
+            workers = i;
+            break;
+        }
+    }
     
-    rhash_library_init();
+    int status = workers > 0 ? 0 : 1;
+    unsigned long files = 0, unreadable = 0, mismatched = 0;
+    unsigned long long bytes = 0;
+    double start = now();
+    struct job next;
+    pthread_mutex_lock(&b.lock);
+    b.eof = workers == 0;
+    while (1) {
+        // Keep the window full, then print whatever is finished at its head
+        while (!b.eof && b.queued - b.printed < b.window) {
+            pthread_mutex_unlock(&b.lock);
+            int more = next_job(src, &next);
+            if (more) {
+                prefetch(next.path);
+            }
+            pthread_mutex_lock(&b.lock);
+            if (!more) {
+                b.eof = 1;
+            } else {
+                next.done = 0;
+                b.jobs[b.queued++ % b.window] = next;
+            }
+            pthread_cond_broadcast(&b.cond);
+        }
+        if (b.printed == b.queued) {
+            break;
+        }
+        struct job *job = &b.jobs[b.printed % b.window];
+        while (!job->done) {
+            pthread_cond_wait(&b.cond, &b.lock);
+        }
+        pthread_mutex_unlock(&b.lock);
+        
+        files++;
+        bytes += job->result < 0 ? 0 : job->timing.bytes;
+        if (job->result < 0) {
+            fprintf(stderr, "Error: Cannot open or read file '%s'\n", job->path);
+            if (src->check) {
+                printf("%s: FAILED open or read\n", job->path);
+            }
+            unreadable++;
+            status = 1;
+        } else if (src->check) {
+            int same = job->algs.formats[0] == RHPR_HEX ? strcasecmp(job->digests[0], job->expected) == 0
+                                                        : strcmp(job->digests[0], job->expected) == 0;
+            printf("%s: %s\n", job->path, same ? "OK" : "FAILED");
+            if (!same) {
+                mismatched++;
+                status = 1;
+            }
+        } else if (job->algs.count == 1) {
+            printf("%s  %s\n", job->digests[0], job->path);
+        } else {
+            // BSD tag lines, one per algorithm
+            for (int i = 0; i < job->algs.count; i++) {
+                printf("%s (%s) = %s\n", job->algs.names[i], job->path, job->digests[i]);
+            }
+        }
+        if (job->result >= 0 && io_options.stats) {
+            fflush(stdout);
+            print_timing(job->path, &job->timing);
+        }
+        free(job->path);
+        
+        pthread_mutex_lock(&b.lock);
+        b.printed++;
+    }
+    pthread_mutex_unlock(&b.lock);
     
-    printf("\tRhasher REPL. Ctrl+D to exit.\n");
-    printf("\tSupported algorithms: MD5, SHA1, TTH\n");
-    printf("\tUsage: <Algorithm> <file> or <Algorithm> \"string\"\n");
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(b.jobs);
+    
+    if (src->check) {
+        double seconds = now() - start;
+        fflush(stdout);
+        if (src->bad_lines) {
+            fprintf(stderr, "Warning: %lu lines are improperly formatted\n", src->bad_lines);
+            status = 1;
+        }
+        if (unreadable) {
+            fprintf(stderr, "Warning: %lu listed files could not be read\n", unreadable);
+        }
+        if (mismatched) {
+            fprintf(stderr, "Warning: %lu of %lu computed checksums did NOT match\n", mismatched, files - unreadable);
+        }
+        fprintf(stderr, "checked %lu files, %.1f MB in %.3f s, %.1f MB/s\n", files, (double)bytes / MB, seconds,
+                seconds > 0 ? bytes / seconds / MB : 0);
+    }
+    return status;
+}
+
+// Commands from stdin. With a terminal there are a banner and prompts; from a
+// pipe or file commands run back to back with fully buffered output and a
+// single line buffer for the whole run.
+int run_repl(void) {
+    int interactive = isatty(STDIN_FILENO);
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    
+    if (interactive) {
+        printf("\tRhasher REPL. Ctrl+D to exit.\n");
+        printf("\tSupported algorithms: MD5, SHA1, TTH\n");
+        printf("\tUsage: <Algorithm> <file> or <Algorithm> \"string\"\n");
+        printf("\tSeveral algorithms at once: MD5,SHA1,TTH <file>\n");
+        printf("\tStrings take \\\" \\\\ \\n \\t \\xHH escapes, '-' hashes the rest of stdin\n");
+    } else {
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
     
     while (1) {
 #ifdef USE_READLINE
-        line = readline("> ");
-        if (!line) break;
-        if (*line) add_history(line);
-#else
-        printf("> ");
-        fflush(stdout);
+        if (interactive) {
+            free(line);
+            line = readline("> ");
+            if (!line) break;
+            if (*line) add_history(line);
+            process_command(line);
+            continue;
+        }
+#endif
+        if (interactive) {
+            printf("> ");
+            fflush(stdout);
+        }
         read = getline(&line, &len, stdin);
         if (read == -1) break;
         if (read > 0 && line[read-1] == '\n') {
             line[read-1] = '\0';
         }
-#endif
-        
-        if (line && strlen(line) > 0) {
-            process_command(line);
-        }
-        
-#ifndef USE_READLINE
-        free(line);
-        line = NULL;
-        len = 0;
-#endif
+        process_command(line);
     }
     
-#ifdef USE_READLINE
-    if (line) free(line);
-#endif
-    
+    free(line);
     // printf("\nGoodbye!\n");
     return 0;
-}
\ No newline at end of file
+}
+
+int finish(int status) {
+    if (cache.records && io_options.stats) {
+        fprintf(stderr, "cache: %lu hits, %lu misses", cache.hits, cache.misses);
+        fprintf(stderr, cache.verify ? ", %lu wrong\n" : "\n", cache.stale);
+    }
+    cache_close();
+    return status;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-j N] [-b MB] [-d] [-s]                         interactive mode\n", name);
+    fprintf(stderr, "       %s -a ALG[,ALG...] [-j N] [-b MB] [-d] [-s] [file...]  hash files ('-' is stdin, no files: paths read from stdin)\n", name);
+    fprintf(stderr, "       %s --check MANIFEST [-a ALG] [-j N] [...]           verify a sha1sum/md5sum/BSD tag manifest\n", name);
+    fprintf(stderr, "  -j N   threads: across files, or across one big file's TTH tree (default: all CPUs)\n");
+    fprintf(stderr, "  -b MB  read buffer size (two per hashing thread, default 4)\n");
+    fprintf(stderr, "  -d     read files with O_DIRECT, bypassing the page cache\n");
+    fprintf(stderr, "  -s     report bytes, time and MB/s for every file on stderr\n");
+    fprintf(stderr, "  -C FILE  reuse digests of unchanged files stored in the cache FILE\n");
+    fprintf(stderr, "  -V     with -C: hash anyway, report and replace wrong cached digests\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"check", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0},
+    };
+    const char *algorithm = NULL, *cache_path = NULL, *manifest = NULL;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:j:b:dsC:Vc:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            manifest = optarg;
+            break;
+        case 'a':
+            algorithm = optarg;
+            break;
+        case 'j':
+            workers = atol(optarg);
+            break;
+        case 'b':
+            io_options.buffer_size = atol(optarg) * MB;
+            break;
+        case 'd':
+            io_options.direct = 1;
+            break;
+        case 's':
+            io_options.stats = 1;
+            break;
+        case 'C':
+            cache_path = optarg;
+            break;
+        case 'V':
+            cache.verify = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((!algorithm && optind < argc) || (manifest && optind < argc) || io_options.buffer_size == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (cache_path && cache_open(cache_path) < 0) {
+        fprintf(stderr, "Error: Cannot open cache file '%s'\n", cache_path);
+        return 1;
+    }
+    // Threads go to files in batch mode, and into the tree of a single big file otherwise
+    workers = workers > 0 ? workers : 1;
+    io_options.tree_threads = !(algorithm || manifest) || argc - optind == 1 ? workers : 1;
+    if (algorithm || manifest) {
+        struct source src = {.files = argv + optind, .nfiles = argc - optind, .check = manifest != NULL};
+        rhash_library_init();
+        if (algorithm && parse_algorithms(algorithm, &src.algs) < 0) {
+            return finish(1);
+        }
+        src.have_algs = algorithm != NULL;
+        if (manifest && strcmp(manifest, "-") != 0 && !(src.list = fopen(manifest, "r"))) {
+            fprintf(stderr, "Error: Cannot open manifest '%s'\n", manifest);
+            return finish(1);
+        } else if (manifest || src.nfiles == 0) {
+            src.list = src.list ? src.list : stdin;
+        }
+        int status = run_batch(&src, workers);
+        if (src.list && src.list != stdin) {
+            fclose(src.list);
+        }
+        return finish(status);
+    }
+    
+    rhash_library_init();
+    return finish(run_repl());
+}
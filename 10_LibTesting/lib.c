@@ -1,5 +1,154 @@
+#define _GNU_SOURCE
 #include "lib.h"
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static void *
+std_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+    (void)ctx;
+    (void)old_size;
+    return realloc(ptr, new_size);
+}
+
+static void
+std_free(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    (void)size;
+    free(ptr);
+}
+
+const struct buf_allocator buf_std_allocator = {std_realloc, std_free, 0};
+
+static void *
+mmap_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+    void *p;
+    (void)ctx;
+    if (!ptr) {
+        p = mmap(0, new_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p == MAP_FAILED ? 0 : p;
+    }
+#ifdef MREMAP_MAYMOVE
+    p = mremap(ptr, old_size, new_size, MREMAP_MAYMOVE);
+    return p == MAP_FAILED ? 0 : p;
+#else
+    p = mmap_realloc(ctx, 0, 0, new_size);
+    if (p) {
+        memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+        munmap(ptr, old_size);
+    }
+    return p;
+#endif
+}
+
+static void
+mmap_free(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    munmap(ptr, size);
+}
+
+const struct buf_allocator buf_mmap_allocator = {mmap_realloc, mmap_free, 0};
+
+#define ARENA_ALIGN 16
+
+/* Only the last block can grow in place or be given back */
+static void *
+arena_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+    struct buf_arena *a = ctx;
+    size_t start;
+    if (ptr && (char *)ptr == a->data + a->last &&
+        new_size <= a->size - a->last) {
+        a->used = a->last + new_size;
+        return ptr;
+    }
+    start = (a->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (start > a->size || new_size > a->size - start)
+        return 0;
+    if (ptr)
+        memcpy(a->data + start, ptr, old_size < new_size ? old_size : new_size);
+    a->last = start;
+    a->used = start + new_size;
+    return a->data + start;
+}
+
+static void
+arena_free(void *ctx, void *ptr, size_t size)
+{
+    struct buf_arena *a = ctx;
+    (void)size;
+    if ((char *)ptr == a->data + a->last)
+        a->used = a->last;
+}
+
+void
+buf_arena_init(struct buf_arena *arena, void *data, size_t size)
+{
+    arena->allocator.realloc = arena_realloc;
+    arena->allocator.free = arena_free;
+    arena->allocator.ctx = arena;
+    arena->data = data;
+    arena->size = size;
+    arena->used = 0;
+    arena->last = 0;
+}
+
+size_t
+buf_grow_double(size_t capacity, size_t esize)
+{
+    (void)esize;
+    return capacity * 2;
+}
+
+size_t
+buf_grow_half(size_t capacity, size_t esize)
+{
+    (void)esize;
+    return capacity + (capacity + 1) / 2;
+}
+
+size_t
+buf_grow_page(size_t capacity, size_t esize)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t n = buf_grow_half(capacity, esize);
+    size_t max = (size_t)-1 - sizeof(struct buf) - page;
+    if (n > max / esize)
+        return n; /* overflow, buf_grow1() fails */
+    return ((sizeof(struct buf) + n * esize + page - 1) / page * page -
+            sizeof(struct buf)) / esize;
+}
+
+void *
+buf_new1(size_t esize, size_t n, buf_growth growth,
+         const struct buf_allocator *allocator)
+{
+    struct buf *p;
+    size_t max = (size_t)-1 - sizeof(struct buf);
+    if (!allocator)
+        allocator = &buf_std_allocator;
+    if (n > max / esize)
+        goto fail; /* overflow */
+    p = allocator->realloc(allocator->ctx, 0, 0,
+                           sizeof(struct buf) + esize * n);
+    if (!p)
+        goto fail;
+    p->capacity = n;
+    p->size = 0;
+    p->allocator = allocator;
+    p->growth = growth ? growth : buf_grow_double;
+    return p->buffer;
+fail:
+    BUF_ABORT;
+    return 0;
+}
 
 void *
 buf_grow1(void *v, size_t esize, ptrdiff_t n)
@@ -10,23 +159,44 @@ buf_grow1(void *v, size_t esize, ptrdiff_t n)
         p = buf_ptr(v);
         if (n > 0 && p->capacity + n > max / esize)
             goto fail; /* overflow */
-        p = realloc(p, sizeof(struct buf) + esize * (p->capacity + n));
+        p = p->allocator->realloc(p->allocator->ctx, p,
+                                  sizeof(struct buf) + esize * p->capacity,
+                                  sizeof(struct buf) + esize * (p->capacity + n));
         if (!p)
             goto fail;
         p->capacity += n;
         if (p->size > p->capacity)
             p->size = p->capacity;
-    } else {
-        if ((size_t)n > max / esize)
-            goto fail; /* overflow */
-        p = malloc(sizeof(struct buf) + esize * n);
-        if (!p)
-            goto fail;
-        p->capacity = n;
-        p->size = 0;
+        return p->buffer;
     }
-    return p->buffer;
+    return buf_new1(esize, n, 0, 0);
 fail:
     BUF_ABORT;
     return 0;
-}
\ No newline at end of file
+}
+
+void *
+buf_push1(void *v, size_t esize, size_t init)
+{
+    struct buf *p;
+    size_t capacity;
+    if (!v)
+        return buf_new1(esize, init, 0, 0);
+    p = buf_ptr(v);
+    capacity = p->capacity ? p->growth(p->capacity, esize) : init;
+    if (capacity <= p->capacity)
+        capacity = p->capacity + 1;
+    if (capacity - p->capacity > PTRDIFF_MAX) {
+        BUF_ABORT; /* overflow */
+        return 0;
+    }
+    return buf_grow1(v, esize, capacity - p->capacity);
+}
+
+void
+buf_free1(void *v, size_t esize)
+{
+    struct buf *p = buf_ptr(v);
+    p->allocator->free(p->allocator->ctx, p,
+                       sizeof(struct buf) + esize * p->capacity);
+}
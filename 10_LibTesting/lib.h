@@ -9,6 +9,26 @@
  *   buf_grow(v, n)  : increase buffer capactity by (ptrdiff_t) N elements
  *   buf_trunc(v, n) : set buffer capactity to exactly (ptrdiff_t) N elements
  *   buf_clear(v, n) : set buffer size to 0 (for push/pop)
+ *   buf_new(v, n, g, a) : create a buffer of capacity N that grows with
+ *                     policy G and gets memory from allocator A (V must be 0)
+ *
+ * Growth policies decide the new capacity when buf_push() finds the
+ * buffer full (0 means the default):
+ *
+ *   buf_grow_double : twice the capacity (the default)
+ *   buf_grow_half   : one and a half times the capacity
+ *   buf_grow_page   : one and a half times, rounded up to whole pages
+ *
+ * Allocators (0 means the default):
+ *
+ *   buf_std_allocator  : malloc(), realloc() and free() (the default)
+ *   buf_mmap_allocator : mmap(), and mremap() on Linux, so that growing a
+ *                        huge buffer moves pages instead of copying them
+ *   buf_arena_init()   : bump allocation from a caller-provided block
+ *
+ * Any other allocator (a pool, jemalloc, ...) plugs in as a struct
+ * buf_allocator. Its realloc gets a null pointer to allocate; its free
+ * gets the size that was allocated.
  *
  * Note: buf_push(), buf_grow(), buf_trunc(), and buf_free() may change
  * the buffer pointer, and any previously-taken pointers should be
@@ -34,19 +54,41 @@
 #  define BUF_ABORT abort()
 #endif
 
+struct buf_allocator {
+    void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+};
+
+typedef size_t (*buf_growth)(size_t capacity, size_t esize);
+
+/* The header stays a multiple of 16 bytes, keeping elements aligned */
 struct buf {
     size_t capacity;
     size_t size;
+    const struct buf_allocator *allocator;
+    buf_growth growth;
     char buffer[];
 };
 
+struct buf_arena {
+    struct buf_allocator allocator;
+    char *data;
+    size_t size;
+    size_t used;
+    size_t last;
+};
+
+extern const struct buf_allocator buf_std_allocator;
+extern const struct buf_allocator buf_mmap_allocator;
+
 #define buf_ptr(v) \
     ((struct buf *)((char *)(v) - offsetof(struct buf, buffer)))
 
 #define buf_free(v) \
     do { \
         if (v) { \
-            free(buf_ptr((v))); \
+            buf_free1((v), sizeof(*(v))); \
             (v) = 0; \
         } \
     } while (0)
@@ -60,10 +102,7 @@ struct buf {
 #define buf_push(v, e) \
     do { \
         if (buf_capacity((v)) == buf_size((v))) { \
-            (v) = buf_grow1(v, sizeof(*(v)), \
-                            !buf_capacity((v)) ? \
-                              BUF_INIT_CAPACITY : \
-                              buf_capacity((v))); \
+            (v) = buf_push1((v), sizeof(*(v)), BUF_INIT_CAPACITY); \
         } \
         (v)[buf_ptr((v))->size++] = (e); \
     } while (0)
@@ -80,4 +119,17 @@ struct buf {
 #define buf_clear(v) \
     ((v) ? (buf_ptr((v))->size = 0) : 0)
 
+#define buf_new(v, n, g, a) \
+    ((v) = buf_new1(sizeof(*(v)), (n), (g), (a)))
+
 void * buf_grow1(void *v, size_t ensize, ptrdiff_t n);
+void * buf_push1(void *v, size_t esize, size_t init);
+void * buf_new1(size_t esize, size_t n, buf_growth growth,
+                const struct buf_allocator *allocator);
+void buf_free1(void *v, size_t esize);
+
+size_t buf_grow_double(size_t capacity, size_t esize);
+size_t buf_grow_half(size_t capacity, size_t esize);
+size_t buf_grow_page(size_t capacity, size_t esize);
+
+void buf_arena_init(struct buf_arena *arena, void *data, size_t size);
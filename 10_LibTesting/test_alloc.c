@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "lib.h"
+
+static int allocs = 0;
+static int frees = 0;
+
+static void *
+counting_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+    (void)ctx;
+    (void)old_size;
+    allocs++;
+    return realloc(ptr, new_size);
+}
+
+static void
+counting_free(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    (void)size;
+    frees++;
+    free(ptr);
+}
+
+int main(void) {
+    int pass = 0;
+    int fail = 0;
+    
+    /* Default growth: doubling from BUF_INIT_CAPACITY */
+    int *ai = 0;
+    for (int i = 0; i < 9; i++)
+        buf_push(ai, i);
+    
+    if (buf_capacity(ai) == 16) { 
+        printf("PASS default double\n"); pass++; 
+    } else { 
+        printf("FAIL default double\n"); fail++; 
+    }
+    buf_free(ai);
+    
+    /* buf_grow_half */
+    buf_new(ai, 0, buf_grow_half, 0);
+    for (int i = 0; i < 9; i++)
+        buf_push(ai, i);
+    
+    if (buf_capacity(ai) == 12) { 
+        printf("PASS grow half\n"); pass++; 
+    } else { 
+        printf("FAIL grow half\n"); fail++; 
+    }
+    buf_free(ai);
+    
+    /* buf_grow_page */
+    long page = sysconf(_SC_PAGESIZE);
+    long *al = 0;
+    buf_new(al, 1, buf_grow_page, &buf_mmap_allocator);
+    buf_push(al, 1);
+    buf_push(al, 2);
+    
+    if ((sizeof(struct buf) + buf_capacity(al) * sizeof(long)) % page == 0) { 
+        printf("PASS grow page\n"); pass++; 
+    } else { 
+        printf("FAIL grow page\n"); fail++; 
+    }
+    
+    /* buf_mmap_allocator */
+    for (long i = 2; i < 1000000; i++)
+        buf_push(al, i + 1);
+    
+    int match = 0;
+    for (long i = 0; i < (long)buf_size(al); i++)
+        match += al[i] == i + 1;
+    
+    if (match == 1000000) { 
+        printf("PASS mmap match 1000000\n"); pass++; 
+    } else { 
+        printf("FAIL mmap match 1000000\n"); fail++; 
+    }
+    buf_free(al);
+    
+    /* Arena */
+    static char memory[4096];
+    struct buf_arena arena;
+    buf_arena_init(&arena, memory, sizeof(memory));
+    buf_new(ai, 0, 0, &arena.allocator);
+    for (int i = 0; i < 100; i++)
+        buf_push(ai, i);
+    
+    match = 0;
+    for (int i = 0; i < (int)buf_size(ai); i++)
+        match += ai[i] == i;
+    
+    if (match == 100 && (char *)ai > memory && (char *)ai < memory + sizeof(memory)) { 
+        printf("PASS arena match 100\n"); pass++; 
+    } else { 
+        printf("FAIL arena match 100\n"); fail++; 
+    }
+    
+    buf_free(ai);
+    if (arena.used == 0) { 
+        printf("PASS arena free\n"); pass++; 
+    } else { 
+        printf("FAIL arena free\n"); fail++; 
+    }
+    
+    /* buf_free() goes through the buffer's allocator */
+    struct buf_allocator counting = {counting_realloc, counting_free, 0};
+    float *a = 0;
+    buf_new(a, 2, 0, &counting);
+    buf_push(a, 1.1f);
+    buf_push(a, 1.2f);
+    buf_push(a, 1.3f);
+    buf_trunc(a, 3);
+    buf_free(a);
+    
+    if (allocs == 3 && frees == 1) { 
+        printf("PASS allocator hooks\n"); pass++; 
+    } else { 
+        printf("FAIL allocator hooks\n"); fail++; 
+    }
+    
+    printf("\n%d fail, %d pass\n", fail, pass);
+    return fail != 0;
+}